@@ -0,0 +1,560 @@
+/*
+ * Copyright 2019 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <string.h>
+
+#include "clap.h"
+
+// Mic bias estimate, in 1/64ths of a reading. Starts as MID_READING, is 
+// calibrated from the average of the first CALIBRATION_BLOCKS blocks, then
+// follows drift slowly.
+static uint16_t mid_q6 = MID_READING * 64;
+
+// Sum and number of readings in the current block
+static uint16_t mid_sum;
+static uint8_t mid_count;
+
+// Calibration progress, and the sum of all readings so far while calibrating
+static uint8_t calibration_blocks;
+static uint32_t calibration_sum;
+
+// Running estimate of audio_squares for background noise
+static uint32_t noise_floor;
+
+// Thresholds in use, adapted to the noise floor
+static uint32_t quiet_threshold = QUIET_THRESHOLD;
+static uint32_t loud_threshold = LOUD_THRESHOLD;
+
+// Filter in front of readingSquare()
+static HighPass high_pass = { MID_READING << 4 };
+
+// Envelope followers of the filtered readings, in 1/16ths of a reading
+static uint16_t envelope_fast;
+static uint16_t envelope_slow;
+
+// Largest gap between the envelopes in the current block, and whether there
+// were any magnitudes to follow
+static uint16_t block_onset;
+static bool block_has_magnitudes;
+
+// Level of the previous block
+static AudioLevel last_level;
+
+#if CLAP_STATS
+ClapStats clap_stats;
+
+static inline void statCount(uint16_t *count) {
+	if (*count != UINT16_MAX) {
+		(*count)++;
+	}
+}
+
+// Counts a block in the histogram
+static void statSquares(uint32_t audio_squares) {
+	uint32_t edge = loud_threshold >> 3;
+	uint8_t bin = 0;
+	while (bin < CLAP_HISTOGRAM_BINS - 1 && audio_squares >= edge) {
+		bin++;
+		edge <<= 1;
+	}
+	statCount(&clap_stats.squares[bin]);
+}
+#endif
+
+uint16_t clapMid() {
+	return mid_q6 >> 6;
+}
+
+void clapReading(uint16_t reading) {
+	mid_sum += reading;
+	mid_count++;
+}
+
+static inline uint16_t follow(uint16_t envelope, uint16_t target, uint8_t rise_shift, uint8_t fall_shift) {
+	if (target > envelope) {
+		return envelope + ((target - envelope) >> rise_shift);
+	}
+	return envelope - ((envelope - target) >> fall_shift);
+}
+
+void clapMagnitude(uint16_t magnitude) {
+	uint16_t target = magnitude << 4;
+	envelope_fast = follow(envelope_fast, target, ENVELOPE_ATTACK_SHIFT, ENVELOPE_RELEASE_SHIFT);
+	envelope_slow = follow(envelope_slow, target, ENVELOPE_SLOW_SHIFT, ENVELOPE_SLOW_SHIFT);
+	if (envelope_fast > envelope_slow && envelope_fast - envelope_slow > block_onset) {
+		block_onset = envelope_fast - envelope_slow;
+	}
+	block_has_magnitudes = true;
+}
+
+uint16_t readingSquare(uint16_t reading) {
+	clapReading(reading);
+	int16_t high = highPass(&high_pass, reading, HIGH_PASS_SHIFT);
+	clapMagnitude(magnitude(high));
+	return squareOf(high);
+}
+
+// Moves the bias estimate towards the average of the block just finished
+static void updateMid() {
+	if (mid_count != NUM_SAMPLES_PER_THRESHOLD) {
+		// Not fed with readings, as in window mode, so there is nothing
+		// to calibrate
+		calibration_blocks = CALIBRATION_BLOCKS;
+		mid_count = 0;
+		mid_sum = 0;
+		return;
+	}
+	// Average of the block in 1/64ths. Exact because there are 16 readings.
+	uint16_t block_q6 = mid_sum * 4;
+	if (calibration_blocks < CALIBRATION_BLOCKS) {
+		calibration_sum += block_q6;
+		calibration_blocks++;
+		mid_q6 = calibration_sum / calibration_blocks;
+	} else {
+		mid_q6 += ((int32_t) block_q6 - mid_q6) >> MID_SHIFT;
+	}
+	mid_count = 0;
+	mid_sum = 0;
+}
+
+// Follows the background noise: down quickly, so that the floor sits under
+// the quietest blocks, and up slowly, so that claps barely move it.
+static void updateNoiseFloor(uint32_t audio_squares) {
+	if (audio_squares < noise_floor) {
+		noise_floor -= (noise_floor - audio_squares) >> NOISE_FALL_SHIFT;
+	} else {
+		noise_floor += (audio_squares - noise_floor) >> NOISE_RISE_SHIFT;
+	}
+	// Quiet is up to twice the floor, and loud keeps the same ratio to quiet
+	// as the fixed thresholds. Neither goes below the fixed thresholds.
+	uint32_t quiet = noise_floor * 2;
+	quiet_threshold = quiet > QUIET_THRESHOLD ? quiet : QUIET_THRESHOLD;
+	loud_threshold = quiet_threshold * 2 + quiet_threshold / 2;
+}
+
+// Returns whether the block just finished had an onset, or true if there is
+// no way to tell
+static bool takeOnset() {
+	bool onset = !block_has_magnitudes || block_onset >= ONSET_THRESHOLD;
+	block_onset = 0;
+	block_has_magnitudes = false;
+	return onset;
+}
+
+AudioLevel calculateCurrentLevel(uint32_t audio_squares) {
+	updateMid();
+	bool onset = takeOnset();
+	if (calibration_blocks < CALIBRATION_BLOCKS) {
+		// Levels are meaningless until the bias is known
+		return QUIET;
+	}
+	updateNoiseFloor(audio_squares);
+
+	AudioLevel level = MID;
+	if (audio_squares >= loud_threshold) {
+		// Loud sounds without an onset are not claps
+		if (onset || last_level == LOUD) {
+			level = LOUD;
+		}
+	} else if (audio_squares <= quiet_threshold) {
+		level = QUIET;
+	} 
+	last_level = level;
+#if CLAP_STATS
+	statCount(&clap_stats.levels[level]);
+	if (level != LOUD && audio_squares >= loud_threshold) {
+		statCount(&clap_stats.no_onset);
+	}
+	statSquares(audio_squares);
+#endif
+	return level;
+}
+
+// Gesture detection.
+// Gestures are sequences of blocks described by patterns. Each pattern is a 
+// list of stages, each of which matches between min and max blocks whose 
+// levels are in an allowed set. This is like a regex - for example a double 
+// clap looks like this, approximately, in regex notation:
+// . = QUIET, _ = MID, X = LOUD
+// .{32},_?X[_X]{0, 7}[._]{0,6}..{2,50}_?X[_X]{0, 8}X[._]{0,6}.{8}
+//
+// All patterns are matched together, a block at a time, as the blocks 
+// arrive. Each pattern is run as a non-deterministic state machine: for each 
+// stage there is a bit mask where bit n is set if some partial match has 
+// consumed n + 1 blocks in that stage. Each block shifts the masks, so the 
+// cost per block is proportional to the total number of stages and does not
+// depend on how long the patterns are.
+//
+// A stage may also restrict the level of the final block it consumes, which 
+// is needed to say that a clap ends with a LOUD. 
+
+// Sets of levels
+#define LEVELS_QUIET (1 << QUIET)
+#define LEVELS_MID (1 << MID)
+#define LEVELS_LOUD (1 << LOUD)
+#define LEVELS_QUIET_MID (LEVELS_QUIET | LEVELS_MID)
+#define LEVELS_MID_LOUD (LEVELS_MID | LEVELS_LOUD)
+#define LEVELS_ANY (LEVELS_QUIET | LEVELS_MID | LEVELS_LOUD)
+
+// Use as max for a stage with no upper limit
+#define STAGE_UNBOUNDED 255
+
+typedef struct {
+	// Levels this stage may consume
+	uint8_t allowed;
+	// Levels allowed for the last block before leaving this stage
+	uint8_t allowed_last;
+	// Whether this stage may consume no blocks at all
+	bool skippable;
+	// Counts that may continue (bits for counts 1 to max)
+	uint32_t keep;
+	// Counts that may leave (bits for counts min to max)
+	uint32_t leave;
+	// Counts that saturate instead of overflowing (only for STAGE_UNBOUNDED)
+	uint32_t sticky;
+} PatternStage;
+
+// Builds a stage from min, max and levels. min and max are at most 32, 
+// except that max may be STAGE_UNBOUNDED.
+#define STAGE_MASK(n) ((n) >= 32 ? 0xffffffffUL : (1UL << (n)) - 1)
+#define STAGE_LAST(min, max, allowed, allowed_last) { (allowed), (allowed_last), (min) == 0, \
+	STAGE_MASK(max), STAGE_MASK(max) & ~STAGE_MASK((min) ? (min) - 1 : 0), \
+	(max) == STAGE_UNBOUNDED ? 0x80000000UL : 0 }
+#define STAGE(min, max, allowed) STAGE_LAST(min, max, allowed, LEVELS_ANY)
+
+// A clap is a run of MIDs and LOUDs ending in a LOUD. It starts with a LOUD,
+// or a MID then a LOUD, and is up to 10 blocks long not counting that MID.
+#define STAGES_CLAP \
+	STAGE(0, 1, LEVELS_MID), \
+	STAGE(1, 1, LEVELS_LOUD), \
+	STAGE_LAST(0, 9, LEVELS_MID_LOUD, LEVELS_LOUD)
+
+// Ramp down after a clap, up to 6 blocks, which may only end in QUIET if 
+// there are 5 or fewer
+#define STAGES_RAMP \
+	STAGE(0, 5, LEVELS_QUIET_MID), \
+	STAGE(0, 1, LEVELS_MID)
+
+// Must have had quiet beforehand
+#define STAGES_LEAD_QUIET STAGE(32, STAGE_UNBOUNDED, LEVELS_QUIET)
+
+// Quiet after the last clap
+#define STAGES_END_QUIET STAGE(8, 8, LEVELS_QUIET)
+
+static const PatternStage double_clap[] PROGMEM = {
+	STAGES_LEAD_QUIET,
+	STAGES_CLAP,
+	STAGES_RAMP,
+	// 2-50 quiets between claps
+	STAGE(2, 25, LEVELS_QUIET), STAGE(0, 25, LEVELS_QUIET),
+	STAGES_CLAP,
+	STAGES_RAMP,
+	STAGES_END_QUIET,
+};
+
+// To tell a triple clap apart from a double clap, the claps must be closer 
+// together, and a double clap is only acted on once no triple clap could 
+// still match.
+static const PatternStage triple_clap[] PROGMEM = {
+	STAGES_LEAD_QUIET,
+	STAGES_CLAP,
+	STAGES_RAMP,
+	STAGE(2, 20, LEVELS_QUIET),
+	STAGES_CLAP,
+	STAGES_RAMP,
+	STAGE(2, 20, LEVELS_QUIET),
+	STAGES_CLAP,
+	STAGES_RAMP,
+	STAGES_END_QUIET,
+};
+
+// A quadruple clap is spaced like a triple clap, and replaces it in the same
+// way
+static const PatternStage quadruple_clap[] PROGMEM = {
+	STAGES_LEAD_QUIET,
+	STAGES_CLAP,
+	STAGES_RAMP,
+	STAGE(2, 20, LEVELS_QUIET),
+	STAGES_CLAP,
+	STAGES_RAMP,
+	STAGE(2, 20, LEVELS_QUIET),
+	STAGES_CLAP,
+	STAGES_RAMP,
+	STAGE(2, 20, LEVELS_QUIET),
+	STAGES_CLAP,
+	STAGES_RAMP,
+	STAGES_END_QUIET,
+};
+
+typedef struct {
+	const PatternStage *stages;
+	// Number of stages, at most 31
+	uint8_t num_stages;
+	GestureAction action;
+} Pattern;
+
+#define PATTERN(stages, action) { stages, sizeof(stages) / sizeof(PatternStage), action }
+
+// Patterns in increasing order of precedence
+static const Pattern patterns[] PROGMEM = {
+	PATTERN(double_clap, ACTION_TOGGLE),
+	PATTERN(triple_clap, ACTION_BRIGHTNESS_STEP),
+	PATTERN(quadruple_clap, ACTION_NEXT_PRESET),
+};
+
+#define NUM_PATTERNS (sizeof(patterns) / sizeof(patterns[0]))
+
+// Must include every pattern in patterns
+#define NUM_PATTERN_STAGES ((sizeof(double_clap) + sizeof(triple_clap) + sizeof(quadruple_clap)) / sizeof(PatternStage))
+
+// Count masks for each stage of each pattern, in order
+static uint32_t pattern_masks[NUM_PATTERN_STAGES];
+
+// For each pattern, bit n is set if a partial match may start stage n with 
+// the next block. If bit num_stages is set, the pattern has just matched.
+static uint32_t pattern_ready[NUM_PATTERNS];
+
+// A match is acted on as soon as no pattern of higher precedence has a 
+// partial match that could replace it, and at most this many blocks later. 
+// Must cover the time from a double clap matching to a triple clap 
+// matching, and from a triple to a quadruple.
+#define GESTURE_SETTLE_BLOCKS 36
+
+// Matched action waiting to settle, its pattern, and blocks remaining
+static GestureAction gesture_pending;
+static uint8_t gesture_pattern;
+static uint8_t gesture_settle;
+
+// Bit p is set if pattern p has a partial match past its lead stage
+static uint8_t patterns_live;
+
+_Static_assert(NUM_PATTERNS <= 8, "patterns_live has a bit per pattern");
+
+// Results of patternUpdate()
+#define PATTERN_MATCHED 1
+#define PATTERN_LIVE 2
+
+// Returned by patternsUpdate() when nothing matched
+#define NO_PATTERN 0xff
+
+#if CLAP_STATS
+_Static_assert(NUM_PATTERNS == CLAP_PATTERNS, "CLAP_PATTERNS must match the patterns");
+_Static_assert(NUM_PATTERN_STAGES == CLAP_STAGES, "CLAP_STAGES must match the patterns");
+
+#if CLAP_STAGE_STATS
+uint8_t clap_stage_rejected[CLAP_STAGES];
+#endif
+
+// For each pattern, the furthest stage of any partial match after the last
+// block
+static uint8_t pattern_furthest[NUM_PATTERNS];
+
+// Counts a rejection when the furthest partial match of a pattern dies
+static void statFurthest(uint8_t pattern, const uint32_t *masks, uint8_t furthest) {
+	uint8_t last = pattern_furthest[pattern];
+	if (furthest < last && last < pgm_read_byte(&patterns[pattern].num_stages)) {
+		statCount(&clap_stats.rejected[pattern]);
+#if CLAP_STAGE_STATS
+		uint8_t *count = &clap_stage_rejected[masks - pattern_masks + last];
+		if (*count != UINT8_MAX) {
+			(*count)++;
+		}
+#else
+		(void) masks;
+#endif
+	}
+	pattern_furthest[pattern] = furthest;
+}
+#endif
+
+// Advance one pattern by a block. Returns PATTERN_MATCHED if the pattern 
+// matched, and PATTERN_LIVE if a partial match is past the lead stage.
+static uint8_t patternUpdate(uint8_t pattern, uint32_t *masks, uint8_t level_bit) {
+	const PatternStage *stage = pgm_read_ptr(&patterns[pattern].stages);
+	uint8_t num_stages = pgm_read_byte(&patterns[pattern].num_stages);
+	uint32_t ready = pattern_ready[pattern];
+	// A match can start at any block
+	uint32_t ready_next = 1;
+	uint8_t furthest = 0;
+	uint8_t result = 0;
+	for (uint8_t i = 0; i < num_stages; i++, stage++) {
+		uint32_t m = masks[i];
+		if (pgm_read_byte(&stage->allowed) & level_bit) {
+			m = ((m << 1) | (m & pgm_read_dword(&stage->sticky))) & pgm_read_dword(&stage->keep);
+			if (ready & (1UL << i)) {
+				m |= 1;
+			}
+		} else {
+			m = 0;
+		}
+		masks[i] = m;
+		if (m) {
+			furthest = i;
+			if (i != 0) {
+				result = PATTERN_LIVE;
+			}
+		}
+		
+		// Could a match leave this stage, to start the next with next block?
+		if (pgm_read_byte(&stage->allowed_last) & level_bit) {
+			if ((m & pgm_read_dword(&stage->leave)) || 
+					(pgm_read_byte(&stage->skippable) && (ready_next & (1UL << i)))) {
+				ready_next |= 1UL << (i + 1);
+				furthest = i + 1;
+			}
+		}
+	}
+	pattern_ready[pattern] = ready_next;
+#if CLAP_STATS
+	statFurthest(pattern, masks, furthest);
+#else
+	(void) furthest;
+#endif
+	if (ready_next & (1UL << num_stages)) {
+		result |= PATTERN_MATCHED;
+	}
+	return result;
+}
+
+// Add a block to every pattern, and update patterns_live. Returns the last 
+// matching pattern, or NO_PATTERN.
+static uint8_t patternsUpdate(AudioLevel level) {
+	uint8_t matched = NO_PATTERN;
+	uint32_t *masks = pattern_masks;
+	patterns_live = 0;
+	for (uint8_t p = 0; p < NUM_PATTERNS; p++) {
+		uint8_t result = patternUpdate(p, masks, 1 << level);
+		if (result & PATTERN_MATCHED) {
+			matched = p;
+		}
+		if (result & PATTERN_LIVE) {
+			patterns_live |= 1 << p;
+		}
+		masks += pgm_read_byte(&patterns[p].num_stages);
+	}
+	return matched;
+}
+
+// Drops every partial match, leaving the patterns ready to start again 
+// after STAGES_LEAD_QUIET
+static void patternsReset() {
+	memset(pattern_masks, 0, sizeof(pattern_masks));
+	for (uint8_t p = 0; p < NUM_PATTERNS; p++) {
+		pattern_ready[p] = 1;
+#if CLAP_STATS
+		pattern_furthest[p] = 0;
+#endif
+	}
+}
+
+// Start patterns off as if there had been a long quiet beforehand, enough
+// for STAGES_LEAD_QUIET.
+void patternsInit() {
+	for (uint8_t i = 0; i < 32; i++) {
+		patternsUpdate(QUIET);
+	}
+#if CLAP_STATS
+	clapStatsReset();
+#endif
+}
+
+#if CLAP_STATS
+void clapStatsReset() {
+	memset(&clap_stats, 0, sizeof(clap_stats));
+#if CLAP_STAGE_STATS
+	memset(clap_stage_rejected, 0, sizeof(clap_stage_rejected));
+#endif
+}
+#endif
+
+// Add a block to the gesture detector. Returns an action once a gesture has
+// matched and settled.
+static GestureAction detectGesture(AudioLevel level) {
+	uint8_t matched = patternsUpdate(level);
+	if (matched != NO_PATTERN) {
+		GestureAction action = pgm_read_byte(&patterns[matched].action);
+#if CLAP_STATS
+		if (gesture_settle != 0 && action != gesture_pending) {
+			statCount(&clap_stats.superseded);
+		}
+#endif
+		gesture_pending = action;
+		gesture_pattern = matched;
+		gesture_settle = GESTURE_SETTLE_BLOCKS;
+	}
+	if (gesture_settle == 0) {
+		return ACTION_NONE;
+	}
+	// Wait while a longer gesture could still replace this one
+	if (--gesture_settle != 0 && (patterns_live >> (gesture_pattern + 1))) {
+		return ACTION_NONE;
+	}
+	gesture_settle = 0;
+	// The same gesture can match again a few blocks later, along a 
+	// different path through its stages
+	patternsReset();
+	return gesture_pending;
+}
+
+bool gestureSettling() {
+	return gesture_settle != 0;
+}
+
+// Blocks left to ignore gestures for
+static uint8_t clap_lockout;
+
+// Whether the last block was MASKED
+static bool clap_masked;
+
+GestureAction clapBlock(AudioLevel level) {
+	if (level == MASKED) {
+#if CLAP_STATS
+		statCount(&clap_stats.masked);
+#endif
+		if (!clap_masked) {
+			patternsReset();
+			gesture_settle = 0;
+			clap_masked = true;
+		}
+		if (clap_lockout) {
+			clap_lockout--;
+		}
+		return ACTION_NONE;
+	}
+	clap_masked = false;
+
+	// The detector must see every block, even while locked out
+	GestureAction action = detectGesture(level);
+#if CLAP_STATS
+	if (action != ACTION_NONE) {
+		statCount(&clap_stats.matched);
+	}
+#endif
+	if (clap_lockout) {
+		clap_lockout--;
+#if CLAP_STATS
+		if (action != ACTION_NONE) {
+			statCount(&clap_stats.locked_out);
+		}
+#endif
+		return ACTION_NONE;
+	}
+	if (action != ACTION_NONE) {
+		clap_lockout = CLAP_LOCKOUT_BLOCKS;
+	}
+	return action;
+}
@@ -0,0 +1,204 @@
+/*
+ * Copyright 2019 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef CLAP_H
+#define CLAP_H
+
+// Clap detection. Turns mic readings into levels, one per block of 
+// NUM_SAMPLES_PER_THRESHOLD readings, and levels into gestures.
+// Nothing here touches the hardware, so it also builds on the host for 
+// sim/clapsim.c.
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "config.h"
+
+#ifdef __AVR__
+#include <avr/pgmspace.h>
+#else
+// Host builds keep tables in RAM
+#define PROGMEM
+#define pgm_read_byte(p) (*(const uint8_t *) (p))
+#define pgm_read_dword(p) (*(const uint32_t *) (p))
+#define pgm_read_ptr(p) (*(void * const *) (p))
+#endif
+
+// This is the expected mid-level audio reading (1.8/2.5 * 1024 / 2). The 
+// actual bias is measured at startup, see clapMid().
+#define MID_READING 369
+
+// >= this value is a loud value for audio_squares, in a quiet room
+#define LOUD_THRESHOLD 50000 
+
+// <= this is a quiet value for audio_squares, in a quiet room
+#define QUIET_THRESHOLD 20000
+
+// Blocks averaged at startup to find the mic bias, about 0.5s. Levels are
+// all QUIET until then.
+#define CALIBRATION_BLOCKS 32
+
+// Time constant of the bias, as a power of two in blocks (about 4s)
+#define MID_SHIFT 8
+
+// Time constants of the noise floor, as powers of two in blocks: falling 
+// takes about 0.1s and rising about 4s
+#define NOISE_FALL_SHIFT 3
+#define NOISE_RISE_SHIFT 8
+
+// Cutoff of the high pass filter in front of the detector, as a power of 
+// two in readings at the 1024Hz tick: 1 is about 110Hz. Claps have most of
+// their energy well above that, thumps and bass below it.
+#define HIGH_PASS_SHIFT 1
+
+// Time constants of the envelope followers, as powers of two in readings. 
+// The fast one rises within a couple of ms and falls over about 8ms, the
+// slow one moves over about 64ms.
+#define ENVELOPE_ATTACK_SHIFT 1
+#define ENVELOPE_RELEASE_SHIFT 3
+#define ENVELOPE_SLOW_SHIFT 6
+
+// A block only becomes LOUD from a quieter one if the fast envelope got this
+// far above the slow one during it, in 1/16ths of a reading: a sudden onset,
+// rather than a sound swelling.
+#define ONSET_THRESHOLD (48 << 4)
+
+#define NUM_SAMPLES_PER_THRESHOLD 16
+
+// Blocks to ignore gestures for after one is detected, about 2 seconds
+#define CLAP_LOCKOUT_BLOCKS 125
+
+typedef enum {
+	QUIET = 0,
+	MID = 1,
+	LOUD = 2,
+	// Not listened to, because the controls are being touched
+	MASKED = 3,
+} AudioLevel;
+
+typedef enum {
+	ACTION_NONE = 0,
+	ACTION_TOGGLE,
+	ACTION_BRIGHTNESS_STEP,
+	ACTION_NEXT_PRESET,
+} GestureAction;
+
+// Bins of ClapStats.squares. Bin 0 is below 1/8 of the loud threshold, and 
+// each bin after that doubles, so bin 3 is just under it and bin 4 just 
+// over.
+#define CLAP_HISTOGRAM_BINS 8
+
+// Patterns, and total stages in them, in clap.c
+#define CLAP_PATTERNS 3
+#define CLAP_STAGES 58
+
+// How detection has been going since clapStatsReset(), kept if CLAP_STATS
+// is set in config.h. Counts stop at their maximum rather than wrapping.
+typedef struct {
+	// Blocks at each level
+	uint16_t levels[3];
+	// Blocks loud enough for LOUD but made MID for lacking an onset
+	uint16_t no_onset;
+	// Blocks by audio_squares relative to the loud threshold in use
+	uint16_t squares[CLAP_HISTOGRAM_BINS];
+	// Gestures matched, those replaced by a different gesture while 
+	// settling, and those ignored during the lockout after the one before
+	uint16_t matched;
+	uint16_t superseded;
+	uint16_t locked_out;
+	// Blocks masked by touches
+	uint16_t masked;
+	// For each pattern, partial matches that died before matching
+	uint16_t rejected[CLAP_PATTERNS];
+} ClapStats;
+
+#if CLAP_STATS
+extern ClapStats clap_stats;
+
+#if CLAP_STAGE_STATS
+// For each stage of each pattern, in order, partial matches that got as far
+// as that stage and no further. Counts stop at UINT8_MAX.
+extern uint8_t clap_stage_rejected[CLAP_STAGES];
+#endif
+
+void clapStatsReset(void);
+#endif
+
+// One pole high pass filter. low is the low frequency part of the signal, 
+// in 1/16ths of a reading, and should start at the mic bias.
+typedef struct {
+	int16_t low;
+} HighPass;
+
+// Returns the reading (0..1023) less its low frequency part. Only shifts and
+// adds, so it is cheap enough for every sample at several kHz.
+static inline int16_t highPass(HighPass *filter, uint16_t reading, uint8_t shift) {
+	int16_t high = (int16_t) (reading << 4) - filter->low;
+	filter->low += high >> shift;
+	return high >> 4;
+}
+
+static inline uint16_t magnitude(int16_t high) {
+	return high < 0 ? -high : high;
+}
+
+// Returns the contribution of a high passed reading to audio_squares
+static inline uint16_t squareOf(int16_t high) {
+	uint16_t diff = magnitude(high) / 2;
+	// Anything bigger is clipping anyway
+	if (diff > 127) {
+		diff = 127;
+	}
+	
+	// calculate RMS, squared * 16
+	return diff * diff;
+}
+
+// Returns the contribution of one reading (0..1023) to audio_squares, after 
+// the high pass filter. Also feeds the reading to the mic bias estimate and
+// the filtered reading to the envelope followers.
+uint16_t readingSquare(uint16_t reading);
+
+// For front ends that filter and square readings themselves, these feed the 
+// mic bias estimate with a reading, and the envelope followers with the 
+// magnitude of a filtered reading. The bias is only updated from blocks of
+// exactly NUM_SAMPLES_PER_THRESHOLD readings, and onsets are only checked
+// in blocks with magnitudes.
+void clapReading(uint16_t reading);
+void clapMagnitude(uint16_t magnitude);
+
+// Returns the level for a block's audio_squares and the onsets seen during 
+// it. Also updates the bias estimate and the noise floor, so must be called
+// once for every block.
+AudioLevel calculateCurrentLevel(uint32_t audio_squares);
+
+// Returns the current estimate of the mic bias reading
+uint16_t clapMid(void);
+
+// Must be called once before the first block
+void patternsInit(void);
+
+// Adds a block to the gesture detector. Returns an action once a gesture
+// has matched and settled, unless locked out by the previous one. A MASKED 
+// block drops any partial or settling match, and the patterns are not run
+// again until the masked blocks end.
+GestureAction clapBlock(AudioLevel level);
+
+// True while a match is waiting to settle
+bool gestureSettling(void);
+
+#endif
@@ -0,0 +1,138 @@
+/*
+ * Copyright 2019 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef CONFIG_H
+#define CONFIG_H
+
+// Build options. Each can be changed here, or set from the compiler command
+// line (for example -DNUM_LEDS=16) to make a separate build configuration.
+// Everything they depend on is a compile time constant, so loops over the
+// LEDs and samples have fixed counts, and features that are off compile out
+// along with their RAM.
+
+//////////////////////////////////////////////////////////////////////
+// Hardware
+
+// Number of LEDs in the string, at most 85, the most that 8 bit indexes 
+// into the frame buffer allow. Buffers that grow with the string must fit 
+// LED_RAM_BUDGET in main.c, which 85 LEDs just do, taking about 510 bytes,
+// if PRESET_FRAMES is off.
+#ifndef NUM_LEDS
+#define NUM_LEDS 8
+#endif
+
+// How data is sent to the LEDs. See "Convert LED to RGB" in main.c.
+// LED_TRANSPORT_BITBANG disables interrupts for the whole frame, 30uS per 
+// LED. LED_TRANSPORT_SPI leaves them enabled, but takes an interrupt for 
+// every SPI byte, every 64 cycles, and by instruction counts most of those 
+// cycles go to entering the ISR and encoding, so the main loop runs only 
+// slowly until the frame is sent. A BENCHMARK build measures both the
+// cycles per SPI byte and the cycles the main loop is left each frame.
+#define LED_TRANSPORT_BITBANG 0
+#define LED_TRANSPORT_SPI 1
+#ifndef LED_TRANSPORT
+#define LED_TRANSPORT LED_TRANSPORT_BITBANG
+#endif
+
+// Pin for bit banged LED data, as a virtual port and a pin number. Atmel
+// START sets PB0 up as the DATA output, so change that to match.
+// LED_TRANSPORT_SPI always uses PA1.
+#ifndef LED_DATA_VPORT
+#define LED_DATA_VPORT VPORTB
+#endif
+#ifndef LED_DATA_PIN
+#define LED_DATA_PIN 0
+#endif
+
+// How mic samples are taken. See "Mic + Clap detection" in main.c.
+#define MIC_MODE_POLLED 0
+#define MIC_MODE_FREE_RUNNING 1
+#define MIC_MODE_WINDOW 2
+#define MIC_MODE_EVENT 3
+#ifndef MIC_MODE
+#define MIC_MODE MIC_MODE_FREE_RUNNING
+#endif
+
+// Conversions per second in MIC_MODE_EVENT. Must be a multiple of 1024. At
+// 8192, the ISR takes a few percent of the CPU.
+#ifndef MIC_EVENT_RATE
+#define MIC_EVENT_RATE 8192UL
+#endif
+
+//////////////////////////////////////////////////////////////////////
+// Features
+
+// Fade between colours, and on and off
+#ifndef FADES
+#define FADES 1
+#endif
+
+// Keep the frame of each preset, so that switching to one is a copy rather
+// than a colour calculation. It takes NUM_PRESETS frames of RAM, so is only 
+// allowed for short strings.
+#define PRESET_FRAMES_MAX_LEDS 16
+#ifndef PRESET_FRAMES
+#define PRESET_FRAMES (NUM_LEDS <= PRESET_FRAMES_MAX_LEDS)
+#endif
+
+// Sleep in standby, waking only on sound or touch, after a while off
+#ifndef LOW_POWER_MODE
+#define LOW_POWER_MODE 1
+#endif
+
+// Accept commands over USART_0. See "Serial control" in main.c.
+#ifndef SERIAL_CONTROL
+#define SERIAL_CONTROL 1
+#endif
+
+// Send the level of every block over USART_0
+#ifndef TELEMETRY
+#define TELEMETRY 1
+#endif
+
+// Keep ClapStats in clap.c, about 40 bytes of RAM and a few uS per block.
+// They are read with SERIAL_CONTROL.
+#ifndef CLAP_STATS
+#define CLAP_STATS 1
+#endif
+
+// With CLAP_STATS, also count rejections for every pattern stage, another
+// 58 bytes
+#ifndef CLAP_STAGE_STATS
+#define CLAP_STAGE_STATS 0
+#endif
+
+// Time the tasks and report over USART_0. See "Instrumentation" in main.c.
+#ifndef INSTRUMENTATION
+#define INSTRUMENTATION 0
+#endif
+
+// Run microbenchmarks instead of the lamp. See "Benchmark" in main.c.
+#ifndef BENCHMARK
+#define BENCHMARK 0
+#endif
+
+// Send mic block mean squares or raw readings, for tuning. See "Capture" in
+// main.c.
+#ifndef CAPTURE_SQUARES
+#define CAPTURE_SQUARES 0
+#endif
+#ifndef CAPTURE_RAW
+#define CAPTURE_RAW 0
+#endif
+
+#endif
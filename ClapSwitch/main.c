@@ -17,33 +17,318 @@
 
 #include <atmel_start.h>
 #include <util/delay.h>
+#include <util/crc16.h>
 #include <avr/pgmspace.h>
 #include <utils/atomic.h>
-#include <stdio.h>
+#include <string.h>
+
+#include "config.h"
+#include "clap.h"
 
 //////////////////////////////////////////////////////////////////////
 // Current tick updates 1024 times per second - approximately equal
 // to a millisecond
 
-// Current tick
-uint32_t tick_millis;
+// Current tick. The ISR changes it between reads of its bytes, so outside
+// ISRs read it with ticks() or ticks16().
+volatile uint32_t tick_millis;
+
+// Amount to add to tick_millis on each RTC interrupt. Larger than 1 while 
+// the PIT is slowed down in low power mode.
+volatile uint16_t tick_step = 1;
+
+// Set by interrupts that should end low power mode
+volatile bool low_power_wake;
+
+// Counts a tick
+static inline void tickElapsed() {
+	tick_millis += tick_step;
+
+	// Clear interrupt flag to indicate that interrupt has been handled.
+	RTC.PITINTFLAGS = RTC_PI_bm;
+}
 
 // ISR to update the tick
-// Fires every ms. May be delayed if running LED update code because that
-// disallows interrupts.
+// Fires every ms. While LEDs are bit banged with interrupts disabled, 
+// sendFrame() calls tickElapsed() itself instead.
 ISR(RTC_PIT_vect)
 {
-	tick_millis++;
+	tickElapsed();
+}
 
-	// Clear interrupt flag to indicate that interrupt has been handled.
-	RTC.PITINTFLAGS = RTC_PI_bm;
+// Returns the current tick
+static inline uint32_t ticks() {
+	ENTER_CRITICAL(R);
+	uint32_t t = tick_millis;
+	EXIT_CRITICAL(R);
+	return t;
+}
+
+// Returns the low 16 bits of the current tick, which is cheaper. Only for
+// intervals of up to 32 seconds.
+static inline uint16_t ticks16() {
+	ENTER_CRITICAL(R);
+	uint16_t t = tick_millis;
+	EXIT_CRITICAL(R);
+	return t;
+}
+
+// Returns the low byte of the current tick. A single byte read is atomic.
+static inline uint8_t ticks8() {
+	return *(volatile uint8_t *) &tick_millis;
+}
+
+// Deadlines are compared by signed difference, so they keep working when 
+// the tick wraps, as long as they are checked within 32 seconds of passing.
+// Code that waits longer than that should instead compare ticks() - start 
+// with the interval, which is also wrap safe.
+typedef uint16_t ShortDeadline;
+
+static inline ShortDeadline shortDeadlineAfter(uint16_t ms) {
+	return ticks16() + ms;
+}
+
+static inline bool shortDeadlinePassed(ShortDeadline deadline) {
+	return (int16_t) (ticks16() - deadline) >= 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Serial output
+// Atmel START sets USART_0 up in polled mode, and transmission is driven 
+// from here: bytes are queued in serial_tx and the DRE interrupt sends them.
+// Queueing never waits, so telemetry can be left on without disturbing 
+// the main loop. With SERIAL_CONTROL, received bytes are queued in 
+// serial_rx by the RXC interrupt, for the parser in "Serial control".
+//
+// Everything is sent as frames:
+//   0xa5 0x5a  sync
+//   type       SERIAL_FRAME_*
+//   length     of the payload
+//   payload
+// Payloads can contain the sync bytes, so readers should check that the 
+// next frame follows where expected before trusting a sync.
+
+#define SERIAL_FRAME_LEVELS 'L'
+#define SERIAL_FRAME_TIMING 'T'
+
+#define SERIAL_FRAME_HEADER_LEN 4
+
+// Must be a power of two, at most 128
+#define SERIAL_TX_LEN 128
+uint8_t serial_tx[SERIAL_TX_LEN];
+
+// Free running counters. Only main code writes head, only the ISR writes 
+// tail.
+volatile uint8_t serial_tx_head;
+volatile uint8_t serial_tx_tail;
+
+// True from queueing a byte until the last byte has been shifted out
+bool serial_tx_busy;
+
+ISR(USART0_DRE_vect)
+{
+	uint8_t tail = serial_tx_tail;
+	if (tail == serial_tx_head) {
+		USART0.CTRLA &= ~USART_DREIE_bm;
+		return;
+	}
+	USART0.TXDATAL = serial_tx[tail & (SERIAL_TX_LEN - 1)];
+	serial_tx_tail = tail + 1;
+}
+
+static void serialPut(uint8_t v) {
+	uint8_t head = serial_tx_head;
+	serial_tx[head & (SERIAL_TX_LEN - 1)] = v;
+	serial_tx_head = head + 1;
+}
+
+// Queues a frame with len bytes of payload. Returns false, having queued
+// nothing, if there isn't room.
+bool serialWriteFrame(uint8_t type, const uint8_t *payload, uint8_t len) {
+	uint8_t used = serial_tx_head - serial_tx_tail;
+	if (SERIAL_FRAME_HEADER_LEN + len > SERIAL_TX_LEN - used) {
+		return false;
+	}
+	serialPut(0xa5);
+	serialPut(0x5a);
+	serialPut(type);
+	serialPut(len);
+	for (uint8_t i = 0; i < len; i++) {
+		serialPut(payload[i]);
+	}
+	serial_tx_busy = true;
+	USART0.STATUS = USART_TXCIF_bm;
+	ENTER_CRITICAL(R);
+	USART0.CTRLA |= USART_DREIE_bm;
+	EXIT_CRITICAL(R);
+	return true;
+}
+
+// True while anything is waiting or being sent. The USART is not clocked 
+// in standby, so the CPU must not go into standby while this is true.
+bool serialBusy() {
+	if (serial_tx_busy && serial_tx_head == serial_tx_tail && (USART0.STATUS & USART_TXCIF_bm)) {
+		serial_tx_busy = false;
+	}
+	return serial_tx_busy;
+}
+
+#if SERIAL_CONTROL
+
+// Must be a power of two, at most 128
+#define SERIAL_RX_LEN 64
+uint8_t serial_rx[SERIAL_RX_LEN];
+
+// Free running counters. Only the ISR writes head, only main code writes 
+// tail.
+volatile uint8_t serial_rx_head;
+volatile uint8_t serial_rx_tail;
+
+// Bytes lost because serial_rx was full, or because the USART overran 
+// before it was read. Wraps.
+volatile uint8_t serial_rx_dropped;
+
+// Moves received bytes into serial_rx. The USART only holds two, which 
+// arrive within 200uS, so sendFrame() also calls this while interrupts are
+// disabled.
+static inline void serialRxReady() {
+	USART0.STATUS = USART_RXSIF_bm;
+	while (USART0.STATUS & USART_RXCIF_bm) {
+		// BUFOVF means at least one byte was lost before this one. It is 
+		// read from RXDATAH before RXDATAL takes the byte.
+		if (USART0.RXDATAH & USART_BUFOVF_bm) {
+			serial_rx_dropped++;
+		}
+		uint8_t v = USART0.RXDATAL;
+		uint8_t head = serial_rx_head;
+		if ((uint8_t) (head - serial_rx_tail) == SERIAL_RX_LEN) {
+			serial_rx_dropped++;
+		} else {
+			serial_rx[head & (SERIAL_RX_LEN - 1)] = v;
+			serial_rx_head = head + 1;
+		}
+	}
+	low_power_wake = true;
+}
+
+// Also fires on start of frame detection, which wakes the CPU from standby
+// in time to receive the byte.
+ISR(USART0_RXC_vect)
+{
+	serialRxReady();
+}
+
+static inline bool serialRxAvailable() {
+	return serial_rx_head != serial_rx_tail;
+}
+
+// Only call when serialRxAvailable()
+static uint8_t serialGet() {
+	uint8_t tail = serial_rx_tail;
+	uint8_t v = serial_rx[tail & (SERIAL_RX_LEN - 1)];
+	serial_rx_tail = tail + 1;
+	return v;
+}
+
+// Starts reception. Atmel START enables the receiver, but not its 
+// interrupts or start of frame detection.
+void serialStart() {
+	USART0.CTRLB |= USART_SFDEN_bm;
+	ENTER_CRITICAL(R);
+	USART0.CTRLA |= USART_RXCIE_bm | USART_RXSIE_bm;
+	EXIT_CRITICAL(R);
+}
+
+#endif
+
+//////////////////////////////////////////////////////////////////////
+// Instrumentation
+// When INSTRUMENTATION is 1, TCA0 free runs at 20MHz / 16, so one count is
+// 0.8uS and it wraps every 52ms. The scheduler times every task and the 
+// whole tick, the LED code times frames sent with interrupts disabled, and 
+// a SERIAL_FRAME_TIMING frame is sent once a second. See reportTask() for 
+// the format.
+//
+// BENCHMARK builds run microbenchmarks instead of the lamp. See the 
+// Benchmark section.
+
+#if INSTRUMENTATION || BENCHMARK
+
+typedef struct {
+	uint16_t min;
+	uint16_t max;
+	uint32_t sum;
+	uint16_t count;
+} StageStats;
+
+void stageAdd(StageStats *stats, uint16_t t) {
+	if (stats->count == 0 || t < stats->min) {
+		stats->min = t;
+	}
+	if (t > stats->max) {
+		stats->max = t;
+	}
+	stats->sum += t;
+	stats->count++;
+}
+
+void stageReset(StageStats *stats) {
+	memset(stats, 0, sizeof(StageStats));
+}
+
+#endif
+
+#if INSTRUMENTATION
+
+// Time spent sending LED frames with interrupts disabled. Any frame over 
+// 1220 counts (about a tick) delayed RTC_PIT_vect.
+StageStats led_frame_stats;
+
+// Ticks that went by without the main loop running
+uint16_t missed_ticks;
+
+void instrumentStart() {
+	TCA0.SINGLE.PER = 0xffff;
+	TCA0.SINGLE.CTRLA = TCA_SINGLE_CLKSEL_DIV16_gc | TCA_SINGLE_ENABLE_bm;
+}
+
+static inline uint16_t instrumentNow() {
+	return TCA0.SINGLE.CNT;
+}
+
+// Records the time since start, which came from instrumentNow()
+void stageRecord(StageStats *stats, uint16_t start) {
+	stageAdd(stats, instrumentNow() - start);
 }
 
+#endif
+
 //////////////////////////////////////////////////////////////////////
 // Configuration related routines
 
 #define MAX_BRIGHT 64
-#define MAX_BRIGHT 191
+#define MAX_HUE 191
+
+// Presets, chosen in turn by a quadruple clap or a long press of the 
+// button. Each keeps its own brightness and hue, and a pattern: spread is 
+// added to the hue for each LED along the string, so 0 is a solid colour
+// and anything else a rainbow.
+#define NUM_PRESETS 4
+
+typedef struct {
+	uint8_t brightness;
+	uint8_t hue;
+	int8_t spread;
+} Preset;
+
+static const Preset default_presets[NUM_PRESETS] PROGMEM = {
+	{ 8, 0, 0 },
+	{ 32, 16, 0 },
+	{ 16, 128, 0 },
+	{ 24, 0, 24 },
+};
+
+Preset presets[NUM_PRESETS];
 
 // Values to save in EEPROM
 typedef struct {
@@ -53,75 +338,296 @@ typedef struct {
 	uint8_t brightness; 
 	// Hue to take range is 0-191, 192 being divisible into 6 regions of 32 steps each
 	uint8_t hue;
+	// Preset being shown. brightness and hue are its current values, and 
+	// are copied back to presets when switching away and when saving.
+	uint8_t preset;
 } Eeprom;
 Eeprom config;
 
-void readConfig() {
-	FLASH_0_read_eeprom_block(0, (uint8_t *) &config, sizeof(Eeprom));
-	if (config.brightness > MAX_BRIGHT) {
-		config.brightness = 8;
+// Layout version of ConfigRecord. The 5 byte records of version 0, with 
+// only seq, on, brightness, hue and check, had no version field; readConfig()
+// migrates them.
+#define CONFIG_VERSION 1
+
+// The config is saved as a log of records spread over the whole EEPROM, so 
+// that each save wears a different place. A save goes in the slot after the
+// newest record, with the next sequence number.
+typedef struct {
+	uint8_t seq;
+	uint8_t version;
+	Eeprom config;
+	Preset presets[NUM_PRESETS];
+	// Makes erased and partly written records invalid. Must be last.
+	uint8_t check;
+} ConfigRecord;
+
+// Records are ordered by the signed difference of their sequence numbers, 
+// which works because there are fewer than 128 of them (13 with 19 byte 
+// records)
+#define CONFIG_RECORDS (EEPROM_SIZE / sizeof(ConfigRecord))
+
+// Slot and sequence number of the newest record
+uint8_t config_slot = CONFIG_RECORDS - 1;
+uint8_t config_seq;
+
+// Contents of the newest record
+Eeprom config_saved;
+Preset presets_saved[NUM_PRESETS];
+
+// Whether readConfig() took the config from a version 0 record, so main() 
+// must save it in the new layout
+bool config_migrated;
+
+// CRC8 of the len bytes before check, including version
+static uint8_t configCheck(const uint8_t *p, uint8_t len) {
+	uint8_t crc = 0;
+	for (uint8_t i = 0; i < len; i++) {
+		crc = _crc8_ccitt_update(crc, p[i]);
 	}
-	if (config.hue > MAX_HUE) {
-		config.hue = 0;
+	return crc;
+}
+
+// Version 0 records
+typedef struct {
+	uint8_t seq;
+	uint8_t on;
+	uint8_t brightness;
+	uint8_t hue;
+	uint8_t check;
+} ConfigRecordV0;
+
+// Sum of the len bytes before check of a version 0 record
+static uint8_t configCheckV0(const uint8_t *p, uint8_t len) {
+	uint8_t sum = 0x5a;
+	for (uint8_t i = 0; i < len; i++) {
+		sum += p[i];
 	}
+	return sum;
 }
 
-// Last time the config was changed
-uint32_t config_change_millis;
+// Takes the newest version 0 record, if any, as the first preset. The old 
+// records are left alone, since the version and CRC keep them from passing
+// as new ones, and config_slot is set so that the first new record doesn't
+// overwrite the one taken. Returns true if a record was found.
+static bool migrateConfig() {
+	bool found = false;
+	uint8_t seq = 0;
+	eeprom_adr_t addr = 0;
+	for (uint8_t slot = 0; slot < EEPROM_SIZE / sizeof(ConfigRecordV0); slot++) {
+		ConfigRecordV0 record;
+		FLASH_0_read_eeprom_block(slot * sizeof(ConfigRecordV0), (uint8_t *) &record, sizeof(ConfigRecordV0));
+		if (record.check != configCheckV0((const uint8_t *) &record, sizeof(ConfigRecordV0) - 1)) {
+			continue;
+		}
+		if (!found || (int8_t) (record.seq - seq) > 0) {
+			found = true;
+			seq = record.seq;
+			addr = slot * sizeof(ConfigRecordV0);
+			config.on = record.on & 1;
+			presets[0].brightness = record.brightness;
+			presets[0].hue = record.hue;
+		}
+	}
+	if (found) {
+		// The old record overlaps at most two new slots, from this one on, 
+		// and writeConfig() uses the slot after config_slot
+		config_slot = (addr / sizeof(ConfigRecord) + 1) % CONFIG_RECORDS;
+	}
+	return found;
+}
+
+// Finds the newest valid record. If there isn't one, presets are left as
+// defaults.
+void readConfig() {
+	bool found = false;
+	memcpy_P(presets, default_presets, sizeof(presets));
+	for (uint8_t slot = 0; slot < CONFIG_RECORDS; slot++) {
+		ConfigRecord record;
+		FLASH_0_read_eeprom_block(slot * sizeof(ConfigRecord), (uint8_t *) &record, sizeof(ConfigRecord));
+		if (record.version != CONFIG_VERSION ||
+				record.check != configCheck((const uint8_t *) &record, sizeof(ConfigRecord) - 1)) {
+			continue;
+		}
+		if (!found || (int8_t) (record.seq - config_seq) > 0) {
+			found = true;
+			config_slot = slot;
+			config_seq = record.seq;
+			config = record.config;
+			memcpy(presets, record.presets, sizeof(presets));
+		}
+	}
+	config_saved = config;
+	memcpy(presets_saved, presets, sizeof(presets));
+	config_migrated = !found && migrateConfig();
+	for (uint8_t i = 0; i < NUM_PRESETS; i++) {
+		if (presets[i].brightness > MAX_BRIGHT) {
+			presets[i].brightness = 8;
+		}
+		if (presets[i].hue > MAX_HUE) {
+			presets[i].hue = 0;
+		}
+	}
+	if (config.preset >= NUM_PRESETS) {
+		config.preset = 0;
+	}
+	config.brightness = presets[config.preset].brightness;
+	config.hue = presets[config.preset].hue;
+}
 
 #define CONFIG_WAIT_MS 500
 
+// When to write the config after the last change. Checked every tick until 
+// written, so a ShortDeadline is enough.
+ShortDeadline config_write_deadline;
+
 // Whether config has been written since last change
 bool config_written = true;
 
-// Whether LEDS have been updated to reflect new config
+// Whether LEDS have been updated to reflect new config, including any fade
 bool leds_updated = false;
 
+// Whether the LEDs should go straight to the new config, without fading
+bool leds_cut = false;
+
 void configChanged() {
-	config_change_millis = tick_millis;
+	config_write_deadline = shortDeadlineAfter(CONFIG_WAIT_MS);
 	config_written = false;
 	leds_updated = false;
 }
 
+// EEPROM is programmed in the background by NVMCTRL_EE_vect, a page at a 
+// time, from a copy of the record being saved. Each page operation takes a 
+// few ms, during which the main loop carries on. In standby the interrupt 
+// may only be serviced on the next tick, which adds at most a ms per page.
+uint8_t eeprom_queue[sizeof(ConfigRecord)];
+eeprom_adr_t eeprom_queue_addr;
+uint8_t eeprom_queue_index;
+
+// True from eepromWrite() until the last byte is programmed
+volatile bool eeprom_busy;
+
+// Runs whenever the EEPROM is ready while bytes are queued. Loads the 
+// changed bytes of one page into the page buffer and starts programming 
+// them. The last byte is programmed on its own, after the rest, because it 
+// is the record's check byte.
+ISR(NVMCTRL_EE_vect)
+{
+	volatile uint8_t *ee = (volatile uint8_t *) (EEPROM_START + eeprom_queue_addr);
+	uint8_t i = eeprom_queue_index;
+	
+	// Skip bytes that already hold the right value
+	while (i < sizeof(eeprom_queue) && ee[i] == eeprom_queue[i]) {
+		i++;
+	}
+	if (i == sizeof(eeprom_queue)) {
+		NVMCTRL.INTCTRL = 0;
+		eeprom_busy = false;
+		return;
+	}
+	
+	uint8_t end = i == sizeof(eeprom_queue) - 1 ? sizeof(eeprom_queue) : sizeof(eeprom_queue) - 1;
+	do {
+		if (ee[i] != eeprom_queue[i]) {
+			ee[i] = eeprom_queue[i];
+		}
+		i++;
+	} while (i < end && ((eeprom_queue_addr + i) & (EEPROM_PAGE_SIZE - 1)) != 0);
+	eeprom_queue_index = i;
+	_PROTECTED_WRITE_SPM(NVMCTRL.CTRLA, NVMCTRL_CMD_PAGEERASEWRITE_gc);
+}
+
+// Queues len bytes to be programmed at addr. Must not be called while
+// eeprom_busy.
+void eepromWrite(eeprom_adr_t addr, const uint8_t *data, uint8_t len) {
+	memcpy(eeprom_queue, data, len);
+	eeprom_queue_addr = addr;
+	eeprom_queue_index = 0;
+	eeprom_busy = true;
+	NVMCTRL.INTCTRL = NVMCTRL_EEREADY_bm;
+}
+
+// Queues config to be appended to the log. Bytes that already hold the 
+// right value, often left from the last time round, are not programmed.
+void writeConfig() {
+	presets[config.preset].brightness = config.brightness;
+	presets[config.preset].hue = config.hue;
+	ConfigRecord record;
+	record.seq = config_seq + 1;
+	record.version = CONFIG_VERSION;
+	record.config = config;
+	memcpy(record.presets, presets, sizeof(presets));
+	record.check = configCheck((const uint8_t *) &record, sizeof(ConfigRecord) - 1);
+	
+	uint8_t slot = config_slot + 1;
+	if (slot == CONFIG_RECORDS) {
+		slot = 0;
+	}
+	eepromWrite(slot * sizeof(ConfigRecord), (const uint8_t *) &record, sizeof(ConfigRecord));
+	config_slot = slot;
+	config_seq = record.seq;
+	config_saved = config;
+	memcpy(presets_saved, presets, sizeof(presets));
+}
+
 // Write the config, if necessary
 void maybeWriteConfig() {
-	if (!config_written && tick_millis > config_change_millis + CONFIG_WAIT_MS) {
-		FLASH_0_write_eeprom_block(0, (uint8_t *) &config, sizeof(Eeprom));
+	// If the previous save is still being programmed, try again next tick
+	if (!config_written && !eeprom_busy && shortDeadlinePassed(config_write_deadline)) {
+		// Changes may have cancelled out. Presets only change when switching
+		// away from them, which also changes config.
+		if (memcmp(&config, &config_saved, sizeof(Eeprom)) != 0 ||
+				memcmp(presets, presets_saved, sizeof(presets)) != 0) {
+			writeConfig();
+		}
 		config_written = true;
 	}
 }
 
 // Updates brightness
-// in must be in (-1, 0 +1)
-// Increments brightness if in is +1, decrements brightness if input is -1
+// Adds in steps to brightness, stopping at 0 and MAX_BRIGHT
 void updateBrightness(int8_t in) {
-	if (in == -1 && config.brightness >= 1) {
-		config.brightness--;
-		configChanged();
+	int16_t brightness = config.brightness + in;
+	if (brightness < 0) {
+		brightness = 0;
+	} else if (brightness > MAX_BRIGHT) {
+		brightness = MAX_BRIGHT;
 	}
-	if (in == 1 && config.brightness < MAX_BRIGHT) {
-		config.brightness++;
+	if (brightness != config.brightness) {
+		config.brightness = brightness;
 		configChanged();
 	}
 }
 
 // Updates hue
-// in must be in (-1, 0 +1)
-// Increments hue if in is +1, decrements hue if input is -1
-// Return true if hue was updated
+// Adds in steps to hue, wrapping around between MAX_HUE and 0
 void updateHue(int8_t in) {
 	if (in == 0) {
 		return;
 	}
-	config.hue += in;
-	if (config.hue == 255) {
-		config.hue = 191;
-	} else if (config.hue == 192) {
-		config.hue = 0;
+	int16_t hue = config.hue + in;
+	while (hue < 0) {
+		hue += MAX_HUE + 1;
+	}
+	while (hue > MAX_HUE) {
+		hue -= MAX_HUE + 1;
 	}
+	config.hue = hue;
 	configChanged();
 }
 
+// Increases brightness by BRIGHTNESS_STEP, wrapping around to 
+// BRIGHTNESS_STEP after MAX_BRIGHT
+#define BRIGHTNESS_STEP 16
+void stepBrightness() {
+	if (config.brightness >= MAX_BRIGHT) {
+		config.brightness = BRIGHTNESS_STEP;
+	} else if (config.brightness > MAX_BRIGHT - BRIGHTNESS_STEP) {
+		config.brightness = MAX_BRIGHT;
+	} else {
+		config.brightness += BRIGHTNESS_STEP;
+	}
+	configChanged();
+}
 
 // toggle whether lamp is on
 void toggleOn() {
@@ -129,18 +635,49 @@ void toggleOn() {
 	configChanged();
 }
 
+// Switches to a preset, which is shown straight away. The current one 
+// keeps any changes.
+void selectPreset(uint8_t preset) {
+	presets[config.preset].brightness = config.brightness;
+	presets[config.preset].hue = config.hue;
+	config.preset = preset;
+	config.brightness = presets[config.preset].brightness;
+	config.hue = presets[config.preset].hue;
+	configChanged();
+	leds_cut = true;
+}
+
+void nextPreset() {
+	selectPreset(config.preset + 1 == NUM_PRESETS ? 0 : config.preset + 1);
+}
+
 
 //////////////////////////////////////////////////////////////////////
 // Track whether controls were touched.
-// Touches are often detected as a loud noise through the microphone.
+// Touches are often detected as a loud noise through the microphone, so the
+// mic is ignored while the controls are in use.
 
 // Last manual control input time
 uint32_t last_touched_millis;
 
+// Blocks within this long of a touch are probably the touch, and are 
+// MASKED
+#define TOUCH_NOISE_MS 250
+
+#if CLAP_STATS
+// Loud blocks that were masked, reported with clap_stats
+uint16_t touch_loud_blocks;
+#endif
+
+// Whether the mic should be ignored, because a control was touched recently
+static inline bool touchMasking() {
+	return ticks() - last_touched_millis < TOUCH_NOISE_MS;
+}
+
 // Updates last_touched_millis if in shows that a control was touched
 int8_t checkTouch(int8_t in) {
 	if (in != 0) {
-		last_touched_millis = tick_millis;
+		last_touched_millis = ticks();
 	}
 	return in;
 }
@@ -148,14 +685,8 @@ int8_t checkTouch(int8_t in) {
 //////////////////////////////////////////////////////////////////////
 // Mic + Clap detection
 
-// This is the expected mid-level audio reading (1.8/2.5 * 1024 / 2)
-#define MID_READING 369
-
-// >= this value is a loud value for audio_squares
-#define LOUD_THRESHOLD 50000 
-
-// <= this is a quiet value for audio_squares
-#define QUIET_THRESHOLD 20000
+// Turning mic readings into levels and detecting gestures is done by 
+// clap.c. This part gets the readings.
 
 // Accumulates squares of readings
 uint32_t audio_squares;
@@ -163,24 +694,46 @@ uint32_t audio_squares;
 // Number of samples in squares
 uint8_t sample_count;
 
-#define NUM_SAMPLES_PER_THRESHOLD 16
-
-typedef enum {
-	QUIET = 0,
-	MID = 1,
-	LOUD = 2,
-} AudioLevel;
-
-// Buffer. Each entry represent 16ms of data, so whole buffer is 128 * 16ms ~= 2s
-#define LEVEL_BUFFER_LEN 128
-AudioLevel level_buffer[LEVEL_BUFFER_LEN];
-uint8_t level_buffer_index = 0;
-
-// Do not detect claps until tick_millis is > this value
-uint32_t clap_lockout_millis = 0;
-
-// How long to lock out
-#define CLAP_LOCKOUT_MS 2000
+#if TELEMETRY
+// Levels of the blocks for the next telemetry frame, each 16ms of data. 
+// Gestures are detected by clap.c, so this is only as long as a frame.
+// Levels are packed 2 bits each, 4 to a byte, as they are sent.
+#define LEVEL_FRAME_BLOCKS 32
+uint8_t level_buffer[LEVEL_FRAME_BLOCKS / 4];
+uint8_t level_buffer_index = LEVEL_FRAME_BLOCKS - 1;
+#endif
+
+// Last time a block was louder than QUIET
+uint32_t last_sound_millis;
+
+// How mic samples are taken.
+// MIC_MODE_POLLED does a blocking conversion from the main loop once per tick.
+// MIC_MODE_FREE_RUNNING lets ADC0 convert continuously, with the RESRDY
+// interrupt collecting results into mic_samples.
+// MIC_MODE_WINDOW also converts continuously, but the ADC window comparator
+// does the work: the CPU is only interrupted for readings far from 
+// MID_READING, and audio_squares is estimated from the count of those once 
+// per block. The mic bias isn't measured in this mode, so the fixed 
+// MID_READING is used throughout.
+// MIC_MODE_EVENT samples at MIC_EVENT_RATE, with TCB0 starting conversions 
+// through the event system. The RESRDY interrupt filters and squares the 
+// readings, and decimates them to one result per ms, so the main loop does
+// the same work as in MIC_MODE_FREE_RUNNING, but each result covers the 
+// whole ms and short transients are not missed between samples.
+// MIC_MODE is set in config.h.
+
+// Readings further than this from MID_READING count as a window hit in 
+// MIC_MODE_WINDOW, and wake the CPU from low power mode
+#define WINDOW_HALF_WIDTH 96
+
+// ADC results are this many conversions accumulated
+#if MIC_MODE == MIC_MODE_EVENT
+#define MIC_RESULT_SCALE 1
+#else
+#define MIC_RESULT_SCALE 2
+#endif
+
+#if MIC_MODE == MIC_MODE_POLLED
 
 // Returns 0..1023 -- actually only 3/4 of the range due to 
 // 1.8V max, measured against 2.5 V reference
@@ -188,183 +741,450 @@ uint16_t micRawRead() {
 	return ADC_0_get_conversion(ADC_MUXPOS_AIN6_gc);
 }
 
-AudioLevel calculateCurrentLevel() {
-	if (audio_squares >= LOUD_THRESHOLD) {
-		return LOUD;
-	} else if (audio_squares <= QUIET_THRESHOLD) {
-		return QUIET;
-	} 
-	return MID;
+#elif MIC_MODE == MIC_MODE_FREE_RUNNING
+
+// Samples waiting to be processed by micRead(). Must be a power of two.
+// 32 samples allows the main loop to fall behind by about one block.
+#define MIC_SAMPLE_BUFFER_LEN 32
+volatile uint16_t mic_samples[MIC_SAMPLE_BUFFER_LEN];
+
+// Free running counters. Only the ISR writes head, only micRead() writes tail.
+volatile uint8_t mic_sample_head;
+volatile uint8_t mic_sample_tail;
+
+// Results arrive roughly every ms, independent of tick_millis and of 
+// interrupts being disabled while LEDs are sent, since a result waits in 
+// ADC0.RES until the interrupt is serviced.
+static inline void micResultReady() {
+	// Reading RES clears the interrupt flag. Two samples are accumulated, 
+	// so halve the result to get back to the 0..1023 range.
+	uint16_t reading = ADC0.RES >> 1;
+	uint8_t head = mic_sample_head;
+	if ((uint8_t) (head - mic_sample_tail) < MIC_SAMPLE_BUFFER_LEN) {
+		mic_samples[head & (MIC_SAMPLE_BUFFER_LEN - 1)] = reading;
+		mic_sample_head = head + 1;
+	}
 }
 
-inline uint8_t bufferIndexSubtract(uint8_t index, uint8_t amount) {
-	if (amount > index) {
-		return LEVEL_BUFFER_LEN - (amount - index);
-	} else {
-		return index - amount;
-	}
+ISR(ADC0_RESRDY_vect)
+{
+	micResultReady();
 }
 
-inline uint8_t bufferIndexAdd(uint8_t index, uint8_t amount) {
-	uint8_t result = index + amount;
-	if (result >= LEVEL_BUFFER_LEN) {
-		result -= LEVEL_BUFFER_LEN;
+#elif MIC_MODE == MIC_MODE_EVENT
+
+// MIC_EVENT_RATE, from config.h, is a multiple of 1024 so that every 
+// MIC_EVENT_DECIMATE conversions make one result per tick
+#define MIC_EVENT_DECIMATE (MIC_EVENT_RATE / 1024)
+
+#if MIC_EVENT_RATE % 1024 || MIC_EVENT_DECIMATE > 64
+#error "MIC_EVENT_RATE must be a multiple of 1024, up to 65536"
+#endif
+
+// Cutoff of the high pass filter at MIC_EVENT_RATE, about 85Hz at 8192Hz
+#define MIC_EVENT_HIGH_PASS_SHIFT 4
+
+// A decimated result: the mean reading, for the bias estimate, and the means
+// of the filtered magnitude and of readingSquare() over the conversions
+typedef struct {
+	uint16_t reading;
+	uint16_t magnitude;
+	uint16_t square;
+} MicSample;
+
+// Results waiting to be processed by micRead(). Must be a power of two.
+#define MIC_SAMPLE_BUFFER_LEN 32
+volatile MicSample mic_samples[MIC_SAMPLE_BUFFER_LEN];
+
+// Free running counters. Only the ISR writes head, only micRead() writes tail.
+volatile uint8_t mic_sample_head;
+volatile uint8_t mic_sample_tail;
+
+// The filter and the result being decimated. Only the ISR uses these.
+HighPass mic_event_filter = { MID_READING << 4 };
+uint16_t mic_event_sum;
+uint16_t mic_event_magnitude;
+uint32_t mic_event_squares;
+uint8_t mic_event_count;
+
+// TCB0 keeps starting conversions while interrupts are disabled, and each
+// one overwrites ADC0.RES, so sendFrame() polls this between LEDs. A 
+// conversion takes more than one LED to arrive, so none is lost.
+static inline void micResultReady() {
+	// Reading RES clears the interrupt flag
+	uint16_t reading = ADC0.RES;
+	int16_t high = highPass(&mic_event_filter, reading, MIC_EVENT_HIGH_PASS_SHIFT);
+	mic_event_sum += reading;
+	mic_event_magnitude += magnitude(high);
+	mic_event_squares += squareOf(high);
+	if (++mic_event_count < MIC_EVENT_DECIMATE) {
+		return;
 	}
-	return result;
+	uint8_t head = mic_sample_head;
+	if ((uint8_t) (head - mic_sample_tail) < MIC_SAMPLE_BUFFER_LEN) {
+		volatile MicSample *sample = &mic_samples[head & (MIC_SAMPLE_BUFFER_LEN - 1)];
+		sample->reading = mic_event_sum / MIC_EVENT_DECIMATE;
+		sample->magnitude = mic_event_magnitude / MIC_EVENT_DECIMATE;
+		sample->square = mic_event_squares / MIC_EVENT_DECIMATE;
+		mic_sample_head = head + 1;
+	}
+	mic_event_sum = 0;
+	mic_event_magnitude = 0;
+	mic_event_squares = 0;
+	mic_event_count = 0;
 }
 
-inline uint8_t bufferIndexNext(uint8_t index) {
-	return bufferIndexAdd(index, 1);
+ISR(ADC0_RESRDY_vect)
+{
+	micResultReady();
 }
 
-void addToBuffer(AudioLevel level) {
-	// Increment index, mod LEVEL_BUFFER_LEN
-	level_buffer_index++;
-	if (level_buffer_index >= LEVEL_BUFFER_LEN) {
-		level_buffer_index = 0;
-	}
-	level_buffer[level_buffer_index] = level;
-}
-
-// For debugging - dump the buffer
-void dumpBuffer() {
-	puts_P(PSTR("\n\n\n"));
-	printf_P(PSTR("%02hx\n"), level_buffer_index);
-	printf_P(PSTR("%06lx\n"), audio_squares);
-	uint8_t i = bufferIndexNext(level_buffer_index);
-	for ( uint8_t count = 0; count < LEVEL_BUFFER_LEN; count++) {
-		if (level_buffer[i] == QUIET) {
-			putchar('.');
-		} else if(level_buffer[i] == LOUD) {
-			putchar('X');
-		} else {
-			putchar('_');
-		}
-		i = bufferIndexNext(i);
-	}
-	puts_P(PSTR("\n---\n---\n"));
+#else
+
+// A block with this many hits is as loud as LOUD_THRESHOLD
+#define WINDOW_LOUD_HITS 6
+
+// Hits are scaled into audio_squares units so that the usual thresholds apply:
+// 0-2 hits is QUIET, 3-5 is MID and 6 or more is LOUD.
+#define WINDOW_SQUARES_PER_HIT (LOUD_THRESHOLD / WINDOW_LOUD_HITS + 1)
+
+// Count of readings outside the window. Only the ISR writes it.
+volatile uint8_t mic_window_hits;
+
+// Value of mic_window_hits at the end of the previous block
+uint8_t mic_window_hits_seen;
+
+// Low byte of tick_millis at the start of the current block
+uint8_t mic_block_tick;
+
+ISR(ADC0_WCOMP_vect)
+{
+	mic_window_hits++;
+	low_power_wake = true;
+	ADC0.INTFLAGS = ADC_WCMP_bm;
+}
+
+#endif
+
+#if MIC_MODE != MIC_MODE_POLLED
+
+#if MIC_MODE == MIC_MODE_EVENT
+
+// Reconfigure ADC0 for conversions of the mic started by TCB0 events.
+// Atmel START sets ADC0 up for single conversions, so this must be called
+// after atmel_start_init().
+// With the 20MHz clock divided by 16, a conversion with SAMPLEN = 8 takes
+// 23 ADC clocks, about 18us, well inside the 122us between events at 8192Hz.
+void micStart() {
+	ADC0.CTRLA = 0;
+	ADC0.CTRLB = ADC_SAMPNUM_ACC1_gc;
+	ADC0.CTRLC = ADC_PRESC_DIV16_gc | ADC_REFSEL_INTREF_gc;
+	ADC0.SAMPCTRL = 8;
+	ADC0.MUXPOS = ADC_MUXPOS_AIN6_gc;
+	ADC0.EVCTRL = ADC_STARTEI_bm;
+	ADC0.INTCTRL = ADC_RESRDY_bm;
+	// RUNSTBY is required because the main loop sleeps in standby mode
+	ADC0.CTRLA = ADC_ENABLE_bm | ADC_RUNSTBY_bm;
+	
+	// TCB0 overflow starts a conversion
+	EVSYS.SYNCCH0 = EVSYS_SYNCCH0_TCB0_gc;
+	EVSYS.ASYNCUSER1 = EVSYS_ASYNCUSER1_SYNCCH0_gc;
+	TCB0.CCMP = F_CPU / MIC_EVENT_RATE - 1;
+	TCB0.CTRLB = TCB_CNTMODE_INT_gc;
+	TCB0.CTRLA = TCB_CLKSEL_CLKDIV1_gc | TCB_ENABLE_bm | TCB_RUNSTDBY_bm;
 }
 
-// For debugging
-void maybeDumpBuffer() {
-	if (level_buffer_index == LEVEL_BUFFER_LEN - 1) {
-		dumpBuffer();
+#else
+
+// Reconfigure ADC0 for free running conversions of the mic.
+// Atmel START sets ADC0 up for single conversions, so this must be called
+// after atmel_start_init().
+// With the 20MHz clock divided by 256, a conversion with SAMPLEN = 25 takes
+// about 38 ADC clocks. Accumulating 2 conversions per result gives roughly
+// 20000000 / 256 / 76 ~= 1028 results per second, close to the 1024Hz tick.
+void micStart() {
+	ADC0.CTRLA = 0;
+	ADC0.CTRLB = ADC_SAMPNUM_ACC2_gc;
+	ADC0.CTRLC = ADC_PRESC_DIV256_gc | ADC_REFSEL_INTREF_gc;
+	ADC0.SAMPCTRL = 25;
+	ADC0.MUXPOS = ADC_MUXPOS_AIN6_gc;
+#if MIC_MODE == MIC_MODE_FREE_RUNNING
+	ADC0.INTCTRL = ADC_RESRDY_bm;
+#else
+	// The window applies to the accumulated result
+	ADC0.WINLT = MIC_RESULT_SCALE * (MID_READING - WINDOW_HALF_WIDTH);
+	ADC0.WINHT = MIC_RESULT_SCALE * (MID_READING + WINDOW_HALF_WIDTH);
+	ADC0.CTRLE = ADC_WINCM_OUTSIDE_gc;
+	ADC0.INTCTRL = ADC_WCMP_bm;
+#endif
+	// RUNSTBY is required because the main loop sleeps in standby mode
+	ADC0.CTRLA = ADC_ENABLE_bm | ADC_FREERUN_bm | ADC_RUNSTBY_bm;
+	ADC0.COMMAND = ADC_STCONV_bm;
+}
+
+#endif
+
+// Switches the ADC between collecting samples and only interrupting when a
+// reading is outside the window, which is what wakes the CPU from low power
+// mode.
+void micLowPower(bool low_power) {
+#if MIC_MODE == MIC_MODE_FREE_RUNNING || MIC_MODE == MIC_MODE_EVENT
+	if (low_power) {
+		ADC0.WINLT = MIC_RESULT_SCALE * (clapMid() - WINDOW_HALF_WIDTH);
+		ADC0.WINHT = MIC_RESULT_SCALE * (clapMid() + WINDOW_HALF_WIDTH);
+		ADC0.CTRLE = ADC_WINCM_OUTSIDE_gc;
+		ADC0.INTFLAGS = ADC_WCMP_bm;
+		ADC0.INTCTRL = ADC_WCMP_bm;
+	} else {
+		ADC0.INTCTRL = ADC_RESRDY_bm;
+		ADC0.CTRLE = ADC_WINCM_NONE_gc;
 	}
+#if MIC_MODE == MIC_MODE_EVENT
+	// A conversion per ms is plenty to notice a sound
+	TCB0.CTRLA = 0;
+	TCB0.CNT = 0;
+	TCB0.CCMP = low_power ? F_CPU / 1024 - 1 : F_CPU / MIC_EVENT_RATE - 1;
+	TCB0.CTRLA = TCB_CLKSEL_CLKDIV1_gc | TCB_ENABLE_bm | TCB_RUNSTDBY_bm;
+#endif
+#else
+	// Window hits already interrupt. The tick jumps while in low power 
+	// mode, so start a fresh block on the way out.
+	if (!low_power) {
+		mic_block_tick = ticks8();
+	}
+#endif
 }
 
+#if MIC_MODE == MIC_MODE_FREE_RUNNING || MIC_MODE == MIC_MODE_EVENT
+// Only enabled in low power mode
+ISR(ADC0_WCOMP_vect)
+{
+	low_power_wake = true;
+	ADC0.INTFLAGS = ADC_WCMP_bm;
+}
+#endif
 
-// All these are defined in terms of buffer indexes
-#define POST_CLAP_MIN_QUIET 8
+#endif
 
-// Return true if found number entries consisting of allowed levels between min and max, going backward in buffer
-// Decrements index as it goes.
-bool checkPrior(uint8_t *i, uint8_t min_required, uint8_t max_allowed, bool quiet_allowed, bool mid_allowed, bool loud_allowed) {
-	uint8_t count = 0;
-	uint8_t end = bufferIndexSubtract(*i, max_allowed);
-	bool condition_met = true;
-	while (*i != end && condition_met) {
-		AudioLevel level = level_buffer[*i];
-		condition_met = (level == QUIET && quiet_allowed)  || (level == MID && mid_allowed) || (level == LOUD && loud_allowed);
-		if (condition_met) {
-			count++;
-			*i = bufferIndexSubtract(*i, 1);
-		}
+#if TELEMETRY
+void addToBuffer(AudioLevel level) {
+	level_buffer_index = (level_buffer_index + 1) & (LEVEL_FRAME_BLOCKS - 1);
+	uint8_t shift = (level_buffer_index & 3) * 2;
+	uint8_t *p = &level_buffer[level_buffer_index >> 2];
+	*p = (*p & ~(3 << shift)) | (level << shift);
+}
+
+// Telemetry. Every LEVEL_FRAME_BLOCKS blocks, their levels are sent in a 
+// SERIAL_FRAME_LEVELS frame:
+//   seq        incremented for every frame, so that dropped frames show
+//   8 bytes    the levels, packed as in level_buffer, oldest first
+// If the serial buffer is full the frame is dropped.
+
+uint8_t level_frame_seq;
+
+void maybeSendLevels() {
+	if (level_buffer_index != LEVEL_FRAME_BLOCKS - 1) {
+		return;
 	}
-	
-	return count >= min_required;
+	uint8_t payload[1 + LEVEL_FRAME_BLOCKS / 4];
+	payload[0] = level_frame_seq++;
+	memcpy(&payload[1], level_buffer, sizeof(level_buffer));
+	serialWriteFrame(SERIAL_FRAME_LEVELS, payload, sizeof(payload));
 }
+#endif
 
-// Analyze the buffer. Return true if detected a double clap.
-// A double clap looks like this, approximately, in regex notation:
-// . = QUIET, _ = MID, X = LOUD
-// .{32},_?X[_X]{0, 7}[._]{0,6}..{2,50}_?X[_X]{0, 8}X[._]{0,6}.{8}
-bool analyzeBuffer() {
-	uint8_t i = level_buffer_index;
-	
-	// This code looks backward over the buffer.
-	
-#define CHECK(min, max, q, m, l) \
-	if (!checkPrior(&i, min, max, q, m, l)) { return false; }
-	// Special check: the actual clap must start with a loud, or have its second be a loud. The rest can be mids.
-#define CHECK_STARTED_LOUD \
-	if (!((level_buffer[bufferIndexAdd(i, 1)] == LOUD) || (level_buffer[bufferIndexAdd(i, 2)] == LOUD)) ) { \
-		return false; \
-	} 
-
-	// Ends with 8 quiet periods	
-	CHECK(8, 8, 1, 0, 0);
-
-	// Ramp down MID/QUIET
-	CHECK(0, 1, 0, 1, 0);
-	CHECK(0, 5, 1, 1, 0);
-	
-	// At least one LOUD
-	CHECK(1, 1, 0, 0, 1);
-	
-	// Mix of mids and louds up to 9 periods - allows for some echo
-	// This is the actual clap, so it must have started loud
-	CHECK(0, 9, 0, 1, 1);
-	CHECK_STARTED_LOUD;
 
-	// Inter-clap quiet
-	CHECK(2, 50, 1, 0, 0);
-	
-	// Ramp down MID/QUIET
-	CHECK(0, 1, 0, 1, 0);
-	CHECK(0, 5, 1, 1, 0);
+// Capture, for tuning the thresholds and patterns from real recordings.
+// CAPTURE_SQUARES sends audio_squares / NUM_SAMPLES_PER_THRESHOLD (the mean
+// square) for every block, and CAPTURE_RAW sends every 
+// CAPTURE_RAW_DECIMATE'th reading. Values are collected into one half of a
+// double buffer while the other half waits for room in serial_tx, and are 
+// sent as frames:
+//   seq        incremented for every frame, including dropped ones
+//   dropped    uint16_t count of frames dropped so far, because the
+//              previous frame was still waiting when the next one filled
+//   values     CAPTURE_LEN uint16_t values
+// All little endian. Capture needs more bandwidth than the default 115200 
+// baud, so USART_0 is switched to CAPTURE_BAUD.
 
-	// At least one LOUD
-	CHECK(1, 1, 0, 0, 1);
+#if CAPTURE_SQUARES || CAPTURE_RAW
+#define CAPTURE_RAW_DECIMATE 1
+#define CAPTURE_BAUD 500000UL
 
-	// Mix of mids and louds up to 9 periods - allows for some echo
-	// This is the actual clap, so it must have started loud
-	CHECK(0, 9, 0, 1, 1);
-	CHECK_STARTED_LOUD;
+#define SERIAL_FRAME_SQUARES 'S'
+#define SERIAL_FRAME_RAW 'R'
 
-	// Must have had quiet beforehand	
-	CHECK(32, 32, 1, 0, 0);
-		
-#undef CHECK
+#define CAPTURE_LEN 16
 
-	clap_lockout_millis = tick_millis + CLAP_LOCKOUT_MS;
-	return true;	
-	
+#if CAPTURE_RAW && MIC_MODE == MIC_MODE_WINDOW
+#error "There are no raw readings to capture in window mode"
+#endif
+
+typedef struct {
+	uint16_t values[2][CAPTURE_LEN];
+	// Half being filled, and the number of values in it
+	uint8_t fill;
+	uint8_t count;
+	// Whether the other half is waiting to be sent, and its sequence number
+	bool pending;
+	uint8_t pending_seq;
+	// Sequence number for the next frame
+	uint8_t seq;
+	uint16_t dropped;
+} Capture;
+
+#if CAPTURE_SQUARES
+Capture capture_squares;
+#endif
+
+#if CAPTURE_RAW
+Capture capture_raw;
+uint8_t capture_raw_skip;
+#endif
+
+void captureStart() {
+	USART0.BAUD = (uint16_t) (4 * F_CPU / CAPTURE_BAUD);
+}
+
+void captureAdd(Capture *capture, uint16_t value) {
+	capture->values[capture->fill][capture->count++] = value;
+	if (capture->count < CAPTURE_LEN) {
+		return;
+	}
+	capture->count = 0;
+	if (capture->pending) {
+		// Keep waiting with the older frame, and refill this one
+		capture->dropped++;
+		capture->seq++;
+		return;
+	}
+	capture->pending = true;
+	capture->pending_seq = capture->seq++;
+	capture->fill ^= 1;
+}
+
+// Queues the waiting half if there is room
+void captureSend(Capture *capture, uint8_t type) {
+	if (!capture->pending) {
+		return;
+	}
+	uint8_t payload[3 + 2 * CAPTURE_LEN];
+	payload[0] = capture->pending_seq;
+	payload[1] = capture->dropped;
+	payload[2] = capture->dropped >> 8;
+	const uint16_t *values = capture->values[capture->fill ^ 1];
+	for (uint8_t i = 0; i < CAPTURE_LEN; i++) {
+		payload[3 + 2 * i] = values[i];
+		payload[4 + 2 * i] = values[i] >> 8;
+	}
+	if (serialWriteFrame(type, payload, sizeof(payload))) {
+		capture->pending = false;
+	}
+}
+#endif
+
+static inline void micCaptureRaw(uint16_t reading) {
+#if CAPTURE_RAW
+	if (++capture_raw_skip == CAPTURE_RAW_DECIMATE) {
+		capture_raw_skip = 0;
+		captureAdd(&capture_raw, reading);
+	}
+#else
+	(void) reading;
+#endif
 }
 
+// Add a single reading to audio_squares
+void micAccumulate(uint16_t reading) {
+	micCaptureRaw(reading);
+	audio_squares += readingSquare(reading);
+	sample_count++;
+}
 
-// Read mic, run processing return true if double-clap detected
+// Read mic, run processing. Returns the action for any gesture detected, or
+// ACTION_NONE.
 // There are several parts to this
 // (a) assemble 16 1-ms samples into a value related to root mean squares, but
 //     not rooted or meaned.
 // (b) Once an RMS block value has been assembled, determine if level is QUIET,
-//     LOUD or MID and record in a circular buffer.
-// (c) Detect whether there have been two claps in a row by examining record.
-// (d) Lock out any further detection for a period.
-bool micRead() {
-	// diff will be in range 0-184 or 185
-	uint16_t reading = micRawRead();
-	int8_t diff = (reading > MID_READING ? reading - MID_READING : MID_READING - reading) / 2;
-	
-	// (a) calculate RMS, squared * 16
-	audio_squares += diff * diff;
-	sample_count++;
+//     LOUD or MID, or MASKED while the controls are in use, and record in a
+//     circular buffer.
+// (c) Detect gestures, such as two claps in a row, with a lockout after
+//     each one.
+GestureAction micRead() {
+	// (a) Accumulate samples
+#if MIC_MODE == MIC_MODE_POLLED
+	micAccumulate(micRawRead());
+#elif MIC_MODE == MIC_MODE_WINDOW
+	// Results arrive at about the tick rate, so a block is 16 ticks.
+	if ((uint8_t) (ticks8() - mic_block_tick) < NUM_SAMPLES_PER_THRESHOLD) {
+		return ACTION_NONE;
+	}
+	mic_block_tick += NUM_SAMPLES_PER_THRESHOLD;
+	uint8_t hits = mic_window_hits;
+	audio_squares = (uint32_t) (uint8_t) (hits - mic_window_hits_seen) * WINDOW_SQUARES_PER_HIT;
+	mic_window_hits_seen = hits;
+	sample_count = NUM_SAMPLES_PER_THRESHOLD;
+#elif MIC_MODE == MIC_MODE_EVENT
+	// Wait until the ISR has decimated a whole block, then consume it. Raw
+	// capture sees the mean readings.
+	uint8_t tail = mic_sample_tail;
+	if ((uint8_t) (mic_sample_head - tail) < NUM_SAMPLES_PER_THRESHOLD) {
+		return ACTION_NONE;
+	}
+	for (uint8_t n = 0; n < NUM_SAMPLES_PER_THRESHOLD; n++) {
+		volatile MicSample *sample = &mic_samples[tail & (MIC_SAMPLE_BUFFER_LEN - 1)];
+		micCaptureRaw(sample->reading);
+		clapReading(sample->reading);
+		clapMagnitude(sample->magnitude);
+		audio_squares += sample->square;
+		sample_count++;
+		tail++;
+	}
+	mic_sample_tail = tail;
+#else
+	// Wait until the ISR has collected a whole block, then consume it
+	uint8_t tail = mic_sample_tail;
+	if ((uint8_t) (mic_sample_head - tail) < NUM_SAMPLES_PER_THRESHOLD) {
+		return ACTION_NONE;
+	}
+	for (uint8_t n = 0; n < NUM_SAMPLES_PER_THRESHOLD; n++) {
+		micAccumulate(mic_samples[tail & (MIC_SAMPLE_BUFFER_LEN - 1)]);
+		tail++;
+	}
+	mic_sample_tail = tail;
+#endif
+
 	if (sample_count == NUM_SAMPLES_PER_THRESHOLD) {
 		// (b) Once we have a block, record it in buffer.
-		addToBuffer(calculateCurrentLevel());
-		maybeDumpBuffer();
+		AudioLevel level = calculateCurrentLevel(audio_squares);
+#if CAPTURE_SQUARES
+		uint32_t mean_square = audio_squares / NUM_SAMPLES_PER_THRESHOLD;
+		captureAdd(&capture_squares, mean_square > 0xffff ? 0xffff : mean_square);
+#endif
+		if (level != QUIET) {
+			last_sound_millis = ticks();
+		}
+		if (touchMasking()) {
+#if CLAP_STATS
+			if (level == LOUD && touch_loud_blocks != UINT16_MAX) {
+				touch_loud_blocks++;
+			}
+#endif
+			level = MASKED;
+		}
+#if TELEMETRY
+		addToBuffer(level);
+		maybeSendLevels();
+#endif
 		audio_squares = 0;
 		sample_count = 0;
 		
-		// (d) Lock out any further detection
-		if (clap_lockout_millis > tick_millis) {
-			return false;
-		}
-		
-		// (c) analyze buffer to detect double claps
-		return analyzeBuffer();
+		// (c) detect gestures
+		return clapBlock(level);
 	}
 	
-	return false;
+	return ACTION_NONE;
 }
 
 //////////////////////////////////////////////////////////////////////
@@ -378,61 +1198,138 @@ bool micRead() {
 // Index is (last_encoder_reading << 2 | // current_reading)
 static const int8_t enc_states [] PROGMEM = {0,-1,1,0,1,0,0,-1,-1,0,0,1,0,1,-1,0};
 
-// Returns -1 on turn one way, 1, the other way and zero for no change.
+// Encoder pins, all on PORTB: ENC_1A PB7, ENC_1B PB6, ENC_2A PB5, ENC_2B PB4.
+// Shifted down by 4, encoder 1 is bits 3-2 and encoder 2 is bits 1-0, each
+// with A above B.
+#define ENC_PINS_gm 0xf0
+
+// Last reading of the encoder pins, shifted down by 4
+uint8_t enc_last;
+
+// Steps counted by the ISR and not yet read
+volatile int8_t enc1_delta;
+volatile int8_t enc2_delta;
+
+// Decodes both encoders on every edge of their pins, so fast turns are not
+// missed between ticks. Also wakes from low power mode.
+ISR(PORTB_PORT_vect)
+{
+	VPORTB.INTFLAGS = VPORTB.INTFLAGS;
+	uint8_t curr = (VPORTB.IN & ENC_PINS_gm) >> 4;
+	uint8_t last = enc_last;
+	enc1_delta += pgm_read_byte(&enc_states[(last & 0xc) | (curr >> 2)]);
+	enc2_delta += pgm_read_byte(&enc_states[(last & 3) << 2 | (curr & 3)]);
+	enc_last = curr;
+	low_power_wake = true;
+}
+
+// Sets the input sense of a PORTB pin, keeping its pullup
+static void setPortBSense(uint8_t pin, uint8_t isc) {
+	register8_t *ctrl = &PORTB.PIN0CTRL + pin;
+	*ctrl = (*ctrl & ~PORT_ISC_gm) | isc;
+}
+
+// Start interrupting on encoder edges
+void encodersStart() {
+	enc_last = (VPORTB.IN & ENC_PINS_gm) >> 4;
+	for (uint8_t pin = 4; pin < 8; pin++) {
+		setPortBSense(pin, PORT_ISC_BOTHEDGES_gc);
+	}
+}
+
+// Returns the number of steps since the last call, negative for turns one
+// way and positive for the other.
 int8_t readEncoder1() {
-	static uint8_t last = 0;
-	uint8_t curr = (ENC_1A_get_level() ? 2 : 0) | (ENC_1B_get_level() ? 1 : 0);
-	int8_t result = pgm_read_byte(&(enc_states[last << 2 | curr]));
-	last = curr;
+	ENTER_CRITICAL(R);
+	int8_t result = enc1_delta;
+	enc1_delta = 0;
+	EXIT_CRITICAL(R);
 	return result;
 }
 
 // Same, but for encoder 2
 int8_t readEncoder2() {
-	static uint8_t last = 0;
-	uint8_t curr = (ENC_2A_get_level() ? 2 : 0) | (ENC_2B_get_level() ? 1 : 0);
-	int8_t result = pgm_read_byte(&(enc_states[last << 2 | curr]));
-	last = curr;
+	ENTER_CRITICAL(R);
+	int8_t result = enc2_delta;
+	enc2_delta = 0;
+	EXIT_CRITICAL(R);
 	return result;
 }
 
-// Read button - -1 = pressed, 1 = released, 0 = no change
+// Read button - 1 = pressed, -1 = released, 0 = no change. The button pulls
+// the pin low.
 int8_t readButton() {
 	static bool last = true;
-	static uint32_t last_change;
+	static uint16_t last_change;
 	bool curr = BUTTON_get_level();
 	if (curr == last) {
 		return 0;
 	}
 	// Ignore changes with 20ms of previous change
-	if (tick_millis - last_change < 20) {
+	uint16_t now = ticks16();
+	if ((uint16_t) (now - last_change) < 20) {
 		return 0;
 	}
 	last = curr;
-	last_change = tick_millis;
+	last_change = now;
 	return curr ? -1 : 1;
 }
 
 //////////////////////////////////////////////////////////////////////
 // Convert LED to RGB and set LEDs to match
 
-// Send a single byte out to WS2812b LEDs on PB0
+// How data is sent to the LEDs.
+// LED_TRANSPORT_BITBANG sends cycle counted bits on the LED data pin, PB0 
+// (DATA) by default, with interrupts disabled for the whole frame, but the 
+// tick kept up to date.
+// LED_TRANSPORT_SPI generates the waveform with SPI0 on PA1 (MOSI), streamed
+// from the SPI interrupt so that interrupts stay enabled. This requires the
+// LED data line to be wired to PA1 instead of PB0.
+// LED_TRANSPORT, the pin and NUM_LEDS are set in config.h.
+
+#define LED_DATA_bm (1 << LED_DATA_PIN)
+
+#if NUM_LEDS > 85
+#error "led_frame is indexed with 8 bits"
+#endif
+
+#define LED_FRAME_LEN (NUM_LEDS * 3)
+
+// RAM allowed for the buffers that grow with the string: led_frame, 
+// control_payload and preset_frames. The rest of the firmware takes about 
+// 1.1KB, or 1.3KB with INSTRUMENTATION, and the stack needs a few hundred 
+// bytes of what is left of the 2KB.
+#define LED_RAM_BUDGET 512
+
+// Frame buffer, in wire order (G, B, R for each LED). Holds the last frame 
+// sent plus any changes waiting to be sent.
+uint8_t led_frame[LED_FRAME_LEN];
+
+// Number of leading bytes of led_frame that need to be sent. The LEDs pass
+// data along the string, so every LED up to the last changed one has to be
+// resent, but LEDs after that keep their colour. The first frame is always 
+// sent in full, in case the LEDs were lit before a reset.
+uint8_t led_dirty_len = LED_FRAME_LEN;
+
+#if LED_TRANSPORT == LED_TRANSPORT_BITBANG
+
+// Send a single byte out to WS2812b LEDs on the LED data pin
 // Assumes 20MHz CPU and that interrupts are disabled
 // For timing see https://wp.josh.com/2014/05/13/ws2812-neopixels-are-not-so-finicky-once-you-get-to-know-them/
 void sendByte(uint8_t v) {
-	// Working with PB0
-	register uint8_t on = VPORTB_OUT | 1;
-	register uint8_t off = VPORTB_OUT & 254;
+	// The virtual port is in I/O space, so each write is a single cycle out
+	register uint8_t on = LED_DATA_VPORT.OUT | LED_DATA_bm;
+	register uint8_t off = LED_DATA_VPORT.OUT & ~LED_DATA_bm;
 	for (uint8_t i = 0; i < 8; i++) {
 		if (v & 0x80) {
-			VPORTB_OUT = on;
+			LED_DATA_VPORT.OUT = on;
 			__builtin_avr_delay_cycles(13); // 0.65uS
-			VPORTB_OUT = off;
+			LED_DATA_VPORT.OUT = off;
 			__builtin_avr_delay_cycles(8); // 0.4uS
 		} else {
-			VPORTB_OUT = on;
+			LED_DATA_VPORT.OUT = on;
 			__builtin_avr_delay_cycles(6); // 0.3uS
-			VPORTB_OUT = off;
+			LED_DATA_VPORT.OUT = off;
 			__builtin_avr_delay_cycles(15); // 0.75uS
 			
 		}
@@ -440,112 +1337,1357 @@ void sendByte(uint8_t v) {
 	}
 }
 
-// Sends RG&B values in correct order to LEDs
-void sendLeds(uint8_t r, uint8_t g, uint8_t b) {
-	DISABLE_INTERRUPTS();
-	for (uint8_t i = 0; i < 8; i++) {
-		sendByte(g);
-		sendByte(b);
-		sendByte(r);
+// Handles the interrupts that can't wait for a whole frame, between LEDs. 
+// Interrupts can't just be enabled for a moment: the line is low between 
+// bits, and an ISR that held it low for more than a few uS would latch the
+// LEDs, so the rest of the frame would start again at the first LED. 
+// Polling the flags costs a few cycles per LED, and the handlers take about
+// a uS, or about 3uS for an event mode conversion, so ticks are never lost
+// however long the string is. Nor are received serial bytes, or mic results
+// in free running and event modes.
+static inline void sendFramePoll() {
+	if (RTC.PITINTFLAGS & RTC_PI_bm) {
+		tickElapsed();
+	}
+#if MIC_MODE == MIC_MODE_FREE_RUNNING || MIC_MODE == MIC_MODE_EVENT
+	if ((ADC0.INTCTRL & ADC_RESRDY_bm) && (ADC0.INTFLAGS & ADC_RESRDY_bm)) {
+		micResultReady();
+	}
+#endif
+#if SERIAL_CONTROL
+	if (USART0.STATUS & (USART_RXCIF_bm | USART_RXSIF_bm)) {
+		serialRxReady();
 	}
+#endif
+}
+
+// Sends the first len bytes of led_frame to the LEDs. Interrupts must be
+// disabled.
+static void sendFrameBytes(uint8_t len) {
+	uint8_t pixel_bytes = 0;
+	for (uint8_t i = 0; i < len; i++) {
+		sendByte(led_frame[i]);
+		if (++pixel_bytes == 3) {
+			pixel_bytes = 0;
+			sendFramePoll();
+		}
+	}
+}
+
+// Sends the first len bytes of led_frame to the LEDs
+void sendFrame(uint8_t len) {
+#if INSTRUMENTATION
+	uint16_t start = instrumentNow();
+#endif
+	DISABLE_INTERRUPTS();
+	sendFrameBytes(len);
 	ENABLE_INTERRUPTS();
+#if INSTRUMENTATION
+	stageRecord(&led_frame_stats, start);
+#endif
+}
+
+// Bit banged frames complete before sendFrame() returns
+static inline bool ledsBusy() { return false; }
+
+#else
+
+// The SPI clock is 20MHz / 8 = 2.5MHz, so each SPI bit is 0.4uS. Each WS2812
+// bit is sent as three SPI bits: 110 for a one (0.8uS high, 0.4uS low) and 
+// 100 for a zero (0.4uS high, 0.8uS low). Every encoded bit ends low, so if 
+// the interrupt is late the line idles low, which the LEDs tolerate for a 
+// few uS.
+#define LED_SPI_BIT(n, b) (((n) >> (b)) & 1 ? 6 : 4)
+#define LED_SPI_NIBBLE(n) (LED_SPI_BIT(n, 3) << 9 | LED_SPI_BIT(n, 2) << 6 | LED_SPI_BIT(n, 1) << 3 | LED_SPI_BIT(n, 0))
+
+// 12 bits of SPI data for each nibble of LED data
+static const uint16_t led_spi_nibbles[] PROGMEM = {
+	LED_SPI_NIBBLE(0), LED_SPI_NIBBLE(1), LED_SPI_NIBBLE(2), LED_SPI_NIBBLE(3),
+	LED_SPI_NIBBLE(4), LED_SPI_NIBBLE(5), LED_SPI_NIBBLE(6), LED_SPI_NIBBLE(7),
+	LED_SPI_NIBBLE(8), LED_SPI_NIBBLE(9), LED_SPI_NIBBLE(10), LED_SPI_NIBBLE(11),
+	LED_SPI_NIBBLE(12), LED_SPI_NIBBLE(13), LED_SPI_NIBBLE(14), LED_SPI_NIBBLE(15),
+};
+
+// Index of the next byte of led_frame to encode, and of the end of the 
+// bytes being sent
+uint8_t led_spi_index;
+uint8_t led_spi_end;
+
+// Encoded SPI bytes for the current byte of led_frame
+uint8_t led_spi_bits[3];
+uint8_t led_spi_bit_index;
+
+// True while the SPI interrupt is sending a frame
+volatile bool led_spi_busy;
+
+// Low byte of tick_millis when the last frame finished
+volatile uint8_t led_spi_done_tick;
+
+// Feeds the SPI transmit buffer one byte at a time, then waits for the last
+// byte to shift out.
+ISR(SPI0_INT_vect)
+{
+	if (SPI0.INTCTRL & SPI_TXCIE_bm) {
+		// Frame complete
+		SPI0.INTFLAGS = SPI_TXCIF_bm;
+		SPI0.INTCTRL = 0;
+		led_spi_done_tick = ticks8();
+		led_spi_busy = false;
+		return;
+	}
+	if (led_spi_bit_index == 3) {
+		if (led_spi_index == led_spi_end) {
+			// Everything is buffered. Wait for transmit complete.
+			SPI0.INTFLAGS = SPI_TXCIF_bm;
+			SPI0.INTCTRL = SPI_TXCIE_bm;
+			return;
+		}
+		uint8_t v = led_frame[led_spi_index++];
+		uint16_t hi = pgm_read_word(&led_spi_nibbles[v >> 4]);
+		uint16_t lo = pgm_read_word(&led_spi_nibbles[v & 0xf]);
+		led_spi_bits[0] = hi >> 4;
+		led_spi_bits[1] = (hi << 4) | (lo >> 8);
+		led_spi_bits[2] = lo;
+		led_spi_bit_index = 0;
+	}
+	SPI0.DATA = led_spi_bits[led_spi_bit_index++];
+}
+
+// Configure SPI0 as a buffered master at 2.5MHz. SS is not used.
+void ledStart() {
+	PORTA.DIRSET = PIN1_bm | PIN3_bm; // MOSI and SCK
+	SPI0.CTRLB = SPI_BUFEN_bm | SPI_SSD_bm | SPI_MODE_0_gc;
+	SPI0.CTRLA = SPI_MASTER_bm | SPI_CLK2X_bm | SPI_PRESC_DIV16_gc | SPI_ENABLE_bm;
+}
+
+// True while a frame is being sent, or the LEDs have not yet latched the 
+// previous frame. Latching takes 50-300uS of low, so waiting for the tick
+// to advance twice is always enough.
+bool ledsBusy() {
+	return led_spi_busy || (uint8_t) (ticks8() - led_spi_done_tick) < 2;
+}
+
+// Starts sending the first len bytes of led_frame to the LEDs. Returns 
+// immediately.
+void sendFrame(uint8_t len) {
+	led_spi_index = 0;
+	led_spi_end = len;
+	led_spi_bit_index = 3;
+	led_spi_busy = true;
+	SPI0.INTCTRL = SPI_DREIE_bm;
+}
+
+#endif
+
+// Sets the colour of one LED in the frame buffer. Only marks it dirty if the 
+// colour changed.
+void ledSet(uint8_t index, uint8_t r, uint8_t g, uint8_t b) {
+	uint8_t *p = &led_frame[index * 3];
+	if (p[0] == g && p[1] == b && p[2] == r) {
+		return;
+	}
+	p[0] = g;
+	p[1] = b;
+	p[2] = r;
+	uint8_t end = index * 3 + 3;
+	if (end > led_dirty_len) {
+		led_dirty_len = end;
+	}
+}
+
+// Sets every LED in the frame buffer to the same colour
+void ledFill(uint8_t r, uint8_t g, uint8_t b) {
+	for (uint8_t i = 0; i < NUM_LEDS; i++) {
+		ledSet(i, r, g, b);
+	}
+}
+
+// Copies a whole frame, in wire order, into the frame buffer. Only marks as
+// far as the last changed byte dirty.
+void ledCopy(const uint8_t *frame) {
+	for (uint8_t end = LED_FRAME_LEN; end > led_dirty_len; end--) {
+		if (led_frame[end - 1] != frame[end - 1]) {
+			led_dirty_len = end;
+			break;
+		}
+	}
+	memcpy(led_frame, frame, LED_FRAME_LEN);
+}
+
+// Sends changes in the frame buffer to the LEDs. Nothing is sent if the frame
+// is unchanged since it was last sent.
+// The frame buffer must not be changed while ledsBusy().
+void ledShow() {
+	if (led_dirty_len) {
+		sendFrame(led_dirty_len);
+		led_dirty_len = 0;
+	}
+}
+
+// Colour conversion is done with two precomputed tables, generated at 
+// compile time by the macros below. They follow
+// https://en.wikipedia.org/wiki/HSL_and_HSV#HSL_to_RGB with S = 1.
+
+// Brightness table. For each brightness, v is L (because lowercase l looks 
+// like 1 and is confusing), in range 1-255 instead of 0-1. It is limited to 1
+// to ensure LEDs are minimally on if lamp is supposed to be on. c is chroma 
+// (0-255) and m is the amount of white to add to each channel.
+#define BRIGHT_V0(b) ((b) * (b) / 16)
+#define BRIGHT_V(b) (BRIGHT_V0(b) > 255 ? 255 : BRIGHT_V0(b) < 1 ? 1 : BRIGHT_V0(b))
+#define BRIGHT_C(b) (2 * BRIGHT_V(b) > 255 ? 510 - 2 * BRIGHT_V(b) : 2 * BRIGHT_V(b))
+#define BRIGHT_ENTRY(b) { BRIGHT_C(b), BRIGHT_V(b) - BRIGHT_C(b) / 2 }
+#define BRIGHT_ROW4(b) BRIGHT_ENTRY(b), BRIGHT_ENTRY((b) + 1), BRIGHT_ENTRY((b) + 2), BRIGHT_ENTRY((b) + 3)
+#define BRIGHT_ROW16(b) BRIGHT_ROW4(b), BRIGHT_ROW4((b) + 4), BRIGHT_ROW4((b) + 8), BRIGHT_ROW4((b) + 12)
+
+#if MAX_BRIGHT != 64
+#error "bright_table below has 65 entries"
+#endif
+
+typedef struct {
+	uint8_t c;
+	uint8_t m;
+} BrightEntry;
+
+static const BrightEntry bright_table[MAX_BRIGHT + 1] PROGMEM = {
+	BRIGHT_ROW16(0), BRIGHT_ROW16(16), BRIGHT_ROW16(32), BRIGHT_ROW16(48),
+	BRIGHT_ENTRY(64),
+};
+
+// Hue table. Gives each channel's share of chroma for each hue.
+// The top 3 bits of hue are the region (0-5) and the bottom 5 bits step 
+// through the region. In each region one channel gets all the chroma, one 
+// gets x, which varies through the region, and one gets none.
+// A weight of w gives (c * (w + 1)) >> 8, so 255 is all of c and 0 is none.
+#define HUE_REGION(h) ((h) >> 5)
+#define HUE_XT(h) (8 * (HUE_REGION(h) & 1 ? ((h) & 0x1f) : 32 - ((h) & 0x1f)))
+#define HUE_X(h) (HUE_XT(h) == 256 ? 0 : 255 - HUE_XT(h))
+#define HUE_WEIGHT(h, c_region1, c_region2, x_region1, x_region2) \
+	(HUE_REGION(h) == (c_region1) || HUE_REGION(h) == (c_region2) ? 255 : \
+	 HUE_REGION(h) == (x_region1) || HUE_REGION(h) == (x_region2) ? HUE_X(h) : 0)
+#define HUE_ENTRY(h) { HUE_WEIGHT(h, 0, 5, 1, 4), HUE_WEIGHT(h, 1, 2, 0, 3), HUE_WEIGHT(h, 3, 4, 2, 5) }
+#define HUE_ROW4(h) HUE_ENTRY(h), HUE_ENTRY((h) + 1), HUE_ENTRY((h) + 2), HUE_ENTRY((h) + 3)
+#define HUE_ROW16(h) HUE_ROW4(h), HUE_ROW4((h) + 4), HUE_ROW4((h) + 8), HUE_ROW4((h) + 12)
+#define HUE_ROW64(h) HUE_ROW16(h), HUE_ROW16((h) + 16), HUE_ROW16((h) + 32), HUE_ROW16((h) + 48)
+
+typedef struct {
+	uint8_t r;
+	uint8_t g;
+	uint8_t b;
+} HueEntry;
+
+static const HueEntry hue_table[MAX_HUE + 1] PROGMEM = {
+	HUE_ROW64(0), HUE_ROW64(64), HUE_ROW64(128),
+};
+
+// Scale chroma by a hue_table weight
+static inline uint8_t chromaShare(uint8_t c, uint8_t weight) {
+	return ((uint16_t) c * (weight + 1)) >> 8;
+}
+
+// Fades. Changes to on/off, brightness and hue move the LEDs a step per 
+// frame towards the config, rather than jumping. Steps are in bright_table
+// and hue_table entries, and bright_table is already gamma corrected, so 
+// the interpolation is perceptually even and costs nothing extra per frame.
+// A change that arrives mid-fade only moves the target: the fade carries on
+// from what is showing. FADES is set in config.h.
+#define FADE_FRAME_MS 10
+
+// Each LED takes 30uS to send. Frames are capped to keep that under a tenth
+// of the time, and to at most one per FADE_FRAME_MS while fading.
+#define LED_FRAME_US (NUM_LEDS * 30UL)
+#define LED_FRAME_MIN_MS (LED_FRAME_US * 10 / 1000 + 1)
+#define LED_FRAME_MS (FADES && FADE_FRAME_MS > LED_FRAME_MIN_MS ? FADE_FRAME_MS : LED_FRAME_MIN_MS)
+
+// Entries to move per frame: the whole brightness range takes about 0.3s 
+// and half way round the hues about 0.25s
+#define FADE_BRIGHT_STEP 2
+#define FADE_HUE_STEP 4
+
+#define NUM_HUES (MAX_HUE + 1)
+
+// What the LEDs are showing. A brightness of -1 is off.
+int8_t shown_brightness = -1;
+uint8_t shown_hue;
+
+// Low 16 bits of tick_millis when the last frame was made
+uint16_t led_frame_tick;
+
+// Returns value moved towards target by at most step
+static int8_t stepTowards(int8_t value, int8_t target, int8_t step) {
+	if (target > value + step) {
+		return value + step;
+	} else if (target < value - step) {
+		return value - step;
+	}
+	return target;
+}
+
+// Wraps hue + diff into 0..MAX_HUE, for diff of at most NUM_HUES either way
+static inline uint8_t hueAdd(uint8_t hue, int16_t diff) {
+	int16_t h = hue + diff;
+	return h < 0 ? h + NUM_HUES : h >= NUM_HUES ? h - NUM_HUES : h;
+}
+
+// Moves what is shown one frame towards the config. Returns true once they
+// match.
+static bool fadeStep() {
+	int8_t brightness = config.on ? config.brightness : -1;
+	if (!FADES || leds_cut || shown_brightness < 0) {
+		// Hue changes while off are not seen, so needn't be faded
+		shown_hue = config.hue;
+	} else {
+		// Go round the short way
+		int16_t hue_diff = config.hue - shown_hue;
+		if (hue_diff > NUM_HUES / 2) {
+			hue_diff -= NUM_HUES;
+		} else if (hue_diff < -NUM_HUES / 2) {
+			hue_diff += NUM_HUES;
+		}
+		shown_hue = hueAdd(shown_hue, stepTowards(0, hue_diff, FADE_HUE_STEP));
+	}
+	if (!FADES || leds_cut) {
+		shown_brightness = brightness;
+	} else {
+		shown_brightness = stepTowards(shown_brightness, brightness, FADE_BRIGHT_STEP);
+	}
+	leds_cut = false;
+	return shown_brightness == brightness && shown_hue == config.hue;
+}
+
+// Calculates RGB into the frame buffer for a brightness (or -1 for off), a 
+// hue for the first LED, and a hue spread along the string
+void colourToLeds(int8_t brightness, uint8_t hue, int8_t spread) {
+	if (brightness < 0) {
+		ledFill(0, 0, 0);
+		return;
+	}
+	uint8_t c = pgm_read_byte(&bright_table[brightness].c);
+	uint8_t m = pgm_read_byte(&bright_table[brightness].m);
+	for (uint8_t i = 0; i < NUM_LEDS; i++) {
+		const HueEntry *entry = &hue_table[hue];
+		ledSet(i, chromaShare(c, pgm_read_byte(&entry->r)) + m,
+			chromaShare(c, pgm_read_byte(&entry->g)) + m,
+			chromaShare(c, pgm_read_byte(&entry->b)) + m);
+		hue = hueAdd(hue, spread);
+	}
+}
+
+#if PRESET_FRAMES
+
+// The frame of each preset, as last calculated, and what it was calculated 
+// from. Switching to a preset, or finishing a fade onto it, is a copy 
+// unless it has been changed since.
+uint8_t preset_frames[NUM_PRESETS][LED_FRAME_LEN];
+Preset preset_frame_keys[NUM_PRESETS];
+uint8_t preset_frames_valid;
+
+#if NUM_PRESETS > 8
+#error "preset_frames_valid has a bit per preset"
+#endif
+
+#if NUM_LEDS > PRESET_FRAMES_MAX_LEDS
+#error "preset_frames would take too much RAM for this many LEDs"
+#endif
+
+// Shows the current preset at rest, from its cached frame if still valid
+static void presetToLeds(int8_t spread) {
+	Preset key = { shown_brightness, shown_hue, spread };
+	uint8_t bit = 1 << config.preset;
+	uint8_t *frame = preset_frames[config.preset];
+	if ((preset_frames_valid & bit) && memcmp(&preset_frame_keys[config.preset], &key, sizeof(Preset)) == 0) {
+		ledCopy(frame);
+	} else {
+		colourToLeds(shown_brightness, shown_hue, spread);
+		memcpy(frame, led_frame, LED_FRAME_LEN);
+		preset_frame_keys[config.preset] = key;
+		preset_frames_valid |= bit;
+	}
 }
 
-// Utility functions
-static inline uint16_t min(uint16_t a, uint16_t b) { return a < b ? a : b; }
-static inline uint16_t max(uint16_t a, uint16_t b) { return a > b ? a : b; }
+#endif
+
+// Fades a frame towards the config and calculates RGB into the frame 
+// buffer. Returns true once the LEDs will show the config.
+bool configToLeds() {
+	bool done = fadeStep();
+	int8_t spread = presets[config.preset].spread;
+#if PRESET_FRAMES
+	if (done && shown_brightness >= 0) {
+		presetToLeds(spread);
+		return done;
+	}
+#endif
+	colourToLeds(shown_brightness, shown_hue, spread);
+	return done;
+}
 
 // Calculate RGB and send to LEDs
 void maybeUpdateLeds() {
-	if (leds_updated) {
+	if (leds_updated || ledsBusy()) {
 		return;
 	}
+	leds_updated = configToLeds();
+	ledShow();
+	led_frame_tick = ticks16();
+}
+
+// Whether it's time for another frame
+bool ledFrameDue() {
+	return (uint16_t) (ticks16() - led_frame_tick) >= LED_FRAME_MS;
+}
+
+
+// How long to wait between last change and writing config eeprom
+#define CONFIG_WRITE_MS 500
+
+//////////////////////////////////////////////////////////////////////
+// Serial control
+// A host, such as a hub driving several lamps, controls the lamp by 
+// sending frames in the same format as those sent, plus a check byte:
+//   0xa5 0x5a  sync
+//   type       SERIAL_FRAME_CONTROL
+//   length     of the payload, at most CONTROL_PAYLOAD_LEN
+//   payload    commands
+//   crc        CRC-8 (polynomial 0x07) of type, length and payload
+// Frames with a bad check byte are dropped. Otherwise their commands run in
+// order, each an opcode followed by its arguments:
+//   'O' n      0 for off, 1 for on, 2 to toggle
+//   'B' n      brightness, 0-MAX_BRIGHT
+//   'H' n      hue, 0-MAX_HUE
+//   'P' n      switch to preset n
+//   'F' i n rgb...  set n LEDs from LED i to the R, G, B triples that follow.
+//              They stay lit until the config next changes.
+//   'S'        reply with a SERIAL_FRAME_STATUS frame
+//   'D'        reply with a SERIAL_FRAME_CLAP_STATS frame, then with 
+//              CLAP_STAGE_STATS a SERIAL_FRAME_CLAP_STAGES frame, and start
+//              the stats again
+// An unknown command, or one cut short or out of range, ends its frame, 
+// leaving earlier commands done. Nothing else is sent back, so a host can 
+// send batches without waiting. The status payload is
+//   on, brightness, hue, preset
+//   ticks      uint32_t tick_millis
+//   frames     uint16_t frames run
+//   errors     uint16_t frames dropped or ended early
+//   dropped    uint8_t bytes lost to a full serial_rx or a USART overrun
+// with every value after preset little endian. The clap stats payload is 
+// ClapStats, from clap.h, followed by a uint16_t count of masked blocks 
+// that would have been LOUD. The clap stages payload is 
+// clap_stage_rejected. The two frames go out in turn, so the second may 
+// count a few more blocks.
+// Received bytes are parsed a few at a time from the scheduler, so a long 
+// batch doesn't hold up clap detection.
+
+#if SERIAL_CONTROL
+
+#define SERIAL_FRAME_CONTROL 'C'
+#define SERIAL_FRAME_STATUS 'I'
+#define SERIAL_FRAME_CLAP_STATS 'D'
+#define SERIAL_FRAME_CLAP_STAGES 'J'
+
+#define CONTROL_ON 'O'
+#define CONTROL_BRIGHTNESS 'B'
+#define CONTROL_HUE 'H'
+#define CONTROL_PRESET 'P'
+#define CONTROL_PIXELS 'F'
+#define CONTROL_STATUS 'S'
+#define CONTROL_CLAP_STATS 'D'
+
+// Longest payload accepted: enough for a whole frame of pixels and a few 
+// more commands, up to the 8 bit length. Longer strings take more than one 
+// frame of 'F' commands.
+#if LED_FRAME_LEN + 16 > 255
+#define CONTROL_PAYLOAD_LEN 255
+#else
+#define CONTROL_PAYLOAD_LEN (LED_FRAME_LEN + 16)
+#endif
+
+#if LED_FRAME_LEN + CONTROL_PAYLOAD_LEN + PRESET_FRAMES * NUM_PRESETS * LED_FRAME_LEN > LED_RAM_BUDGET
+#error "The LED buffers take more than LED_RAM_BUDGET"
+#endif
+
+// Most bytes parsed per tick. 115200 baud delivers under 12 bytes a tick.
+#define CONTROL_BYTES_PER_TICK 32
+
+#define CONTROL_STATUS_LEN 13
+
+// Parser states, named after the byte expected next. CONTROL_READY holds a 
+// checked frame that hasn't been run yet.
+enum {
+	CONTROL_SYNC1,
+	CONTROL_SYNC2,
+	CONTROL_TYPE,
+	CONTROL_LEN,
+	CONTROL_PAYLOAD,
+	CONTROL_CRC,
+	CONTROL_READY,
+};
+
+uint8_t control_state = CONTROL_SYNC1;
+uint8_t control_payload[CONTROL_PAYLOAD_LEN];
+uint8_t control_len;
+uint8_t control_index;
+uint8_t control_crc;
+
+// For the status frame
+uint16_t control_frames;
+uint16_t control_errors;
+
+// Whether a status frame is waiting for room in serial_tx
+bool control_status_pending;
+
+#if CLAP_STATS
+// The same for the clap stats frames: the number still to send
+uint8_t control_clap_stats_pending;
+
+#if CLAP_STAGE_STATS
+#define CONTROL_CLAP_STATS_FRAMES 2
+#else
+#define CONTROL_CLAP_STATS_FRAMES 1
+#endif
+#endif
+
+// Tick of the last frame run, which holds off low power mode
+uint32_t last_control_millis;
+
+// Takes the next received byte
+static void controlParse(uint8_t v) {
+	switch (control_state) {
+	case CONTROL_SYNC1:
+		if (v == 0xa5) {
+			control_state = CONTROL_SYNC2;
+		}
+		break;
+	case CONTROL_SYNC2:
+		control_state = v == 0x5a ? CONTROL_TYPE : v == 0xa5 ? CONTROL_SYNC2 : CONTROL_SYNC1;
+		break;
+	case CONTROL_TYPE:
+		if (v != SERIAL_FRAME_CONTROL) {
+			control_errors++;
+			control_state = CONTROL_SYNC1;
+			break;
+		}
+		control_crc = _crc8_ccitt_update(0, v);
+		control_state = CONTROL_LEN;
+		break;
+	case CONTROL_LEN:
+#if CONTROL_PAYLOAD_LEN < 255
+		if (v > CONTROL_PAYLOAD_LEN) {
+			control_errors++;
+			control_state = CONTROL_SYNC1;
+			break;
+		}
+#endif
+		control_crc = _crc8_ccitt_update(control_crc, v);
+		control_len = v;
+		control_index = 0;
+		control_state = v ? CONTROL_PAYLOAD : CONTROL_CRC;
+		break;
+	case CONTROL_PAYLOAD:
+		control_crc = _crc8_ccitt_update(control_crc, v);
+		control_payload[control_index++] = v;
+		if (control_index == control_len) {
+			control_state = CONTROL_CRC;
+		}
+		break;
+	case CONTROL_CRC:
+		if (v != control_crc) {
+			control_errors++;
+			control_state = CONTROL_SYNC1;
+			break;
+		}
+		control_state = CONTROL_READY;
+		break;
+	}
+}
+
+// Runs the commands in control_payload. Returns false if one was bad.
+// Must not be called while ledsBusy().
+static bool controlRun() {
+	const uint8_t *p = control_payload;
+	const uint8_t *end = p + control_len;
+	while (p < end) {
+		uint8_t op = *p++;
+		if (op == CONTROL_STATUS) {
+			control_status_pending = true;
+			continue;
+		}
+#if CLAP_STATS
+		if (op == CONTROL_CLAP_STATS) {
+			control_clap_stats_pending = CONTROL_CLAP_STATS_FRAMES;
+			continue;
+		}
+#endif
+		if (p == end) {
+			return false;
+		}
+		uint8_t arg = *p++;
+		switch (op) {
+		case CONTROL_ON:
+			if (arg > 2) {
+				return false;
+			}
+			if (arg == 2 || arg != config.on) {
+				toggleOn();
+			}
+			break;
+		case CONTROL_BRIGHTNESS:
+			if (arg > MAX_BRIGHT) {
+				return false;
+			}
+			if (arg != config.brightness) {
+				config.brightness = arg;
+				configChanged();
+			}
+			break;
+		case CONTROL_HUE:
+			if (arg > MAX_HUE) {
+				return false;
+			}
+			if (arg != config.hue) {
+				config.hue = arg;
+				configChanged();
+			}
+			break;
+		case CONTROL_PRESET:
+			if (arg >= NUM_PRESETS) {
+				return false;
+			}
+			if (arg != config.preset) {
+				selectPreset(arg);
+			}
+			break;
+		case CONTROL_PIXELS:
+			if (p == end) {
+				return false;
+			}
+			uint8_t count = *p++;
+			if (arg + count > NUM_LEDS || end - p < count * 3) {
+				return false;
+			}
+			for (uint8_t i = 0; i < count; i++, p += 3) {
+				ledSet(arg + i, p[0], p[1], p[2]);
+			}
+			// Shown instead of the config until it next changes
+			leds_updated = true;
+			break;
+		default:
+			return false;
+		}
+	}
+	return true;
+}
+
+static void controlSendStatus() {
+	uint8_t payload[CONTROL_STATUS_LEN];
+	uint32_t t = ticks();
+	payload[0] = config.on;
+	payload[1] = config.brightness;
+	payload[2] = config.hue;
+	payload[3] = config.preset;
+	payload[4] = t;
+	payload[5] = t >> 8;
+	payload[6] = t >> 16;
+	payload[7] = t >> 24;
+	payload[8] = control_frames;
+	payload[9] = control_frames >> 8;
+	payload[10] = control_errors;
+	payload[11] = control_errors >> 8;
+	payload[12] = serial_rx_dropped;
+	if (serialWriteFrame(SERIAL_FRAME_STATUS, payload, sizeof(payload))) {
+		control_status_pending = false;
+	}
+}
+
+#if CLAP_STATS
+static void controlSendClapStats() {
+	if (control_clap_stats_pending == CONTROL_CLAP_STATS_FRAMES) {
+		uint8_t payload[sizeof(ClapStats) + 2];
+		memcpy(payload, &clap_stats, sizeof(ClapStats));
+		payload[sizeof(ClapStats)] = touch_loud_blocks;
+		payload[sizeof(ClapStats) + 1] = touch_loud_blocks >> 8;
+		if (!serialWriteFrame(SERIAL_FRAME_CLAP_STATS, payload, sizeof(payload))) {
+			return;
+		}
+		control_clap_stats_pending--;
+	}
+#if CLAP_STAGE_STATS
+	if (!serialWriteFrame(SERIAL_FRAME_CLAP_STAGES, clap_stage_rejected, CLAP_STAGES)) {
+		return;
+	}
+	control_clap_stats_pending--;
+#endif
+	clapStatsReset();
+	touch_loud_blocks = 0;
+}
+#endif
+
+bool controlReady() {
+#if CLAP_STATS
+	if (control_clap_stats_pending) {
+		return true;
+	}
+#endif
+	return serialRxAvailable() || control_state == CONTROL_READY || control_status_pending;
+}
+
+// True while a frame is part received. The CPU stays out of standby until 
+// it is done, so the rest arrives reliably.
+bool controlBusy() {
+	return control_state != CONTROL_SYNC1 || serialRxAvailable();
+}
+
+// Whether no frame has been run for ms, and none is arriving
+bool controlIdleFor(uint32_t ms) {
+	return !controlBusy() && ticks() - last_control_millis >= ms;
+}
+
+// Parses up to CONTROL_BYTES_PER_TICK received bytes, running any frames 
+// they complete. A frame waits for the LEDs if they are busy, and parsing 
+// waits with it.
+void controlTask() {
+	uint8_t n = CONTROL_BYTES_PER_TICK;
+	while (true) {
+		if (control_state == CONTROL_READY) {
+			if (ledsBusy()) {
+				break;
+			}
+			if (controlRun()) {
+				control_frames++;
+			} else {
+				control_errors++;
+			}
+			if (leds_updated) {
+				// Sends any pixels set. Otherwise the frame is unchanged.
+				ledShow();
+				led_frame_tick = ticks16();
+			}
+			last_control_millis = ticks();
+			control_state = CONTROL_SYNC1;
+		}
+		if (n-- == 0 || !serialRxAvailable()) {
+			break;
+		}
+		controlParse(serialGet());
+	}
+	if (control_status_pending) {
+		controlSendStatus();
+	}
+#if CLAP_STATS
+	if (control_clap_stats_pending) {
+		controlSendClapStats();
+	}
+#endif
+}
+
+#else
+
+static inline bool controlBusy() { return false; }
+static inline bool controlIdleFor(uint32_t ms) { (void) ms; return true; }
+
+#endif
+
+//////////////////////////////////////////////////////////////////////
+// Low power mode
+// Once the lamp is off and nothing has happened for a while, the CPU stops 
+// waking for every tick. It stays in standby until a control moves or the 
+// mic hears something outside the ADC window, with the RTC PIT slowed to 
+// once a second so that tick_millis keeps roughly counting.
+//
+// Target average current in low power mode is under 0.5mA, measured at the
+// ATtiny3217 supply. The ADC keeps running, and with it the 20MHz 
+// oscillator, so that the window comparator can hear claps; that is most of 
+// the budget. The target excludes the mic amplifier and the WS2812s, which 
+// draw current even when dark. LOW_POWER_MODE is set in config.h.
+
+// Enter low power mode after this long with the lamp off, no sound and no 
+// touches
+#define LOW_POWER_DELAY_MS 10000
+
+#if LOW_POWER_MODE && MIC_MODE == MIC_MODE_POLLED
+#error "Low power mode needs the ADC running to wake on sound"
+#endif
+
+#if LOW_POWER_MODE
+
+// In standby only BOTHEDGES is detected on pins that are not fully 
+// asynchronous. The encoders always interrupt, so only the button needs 
+// changing.
+static void setControlSense(uint8_t isc) {
+	setPortBSense(1, isc);
+}
+
+// Sets the PIT period and the matching tick_millis increment
+static void setTickPeriod(uint8_t period, uint16_t step) {
+	while (RTC.PITSTATUS & RTC_CTRLBUSY_bm);
+	RTC.PITCTRLA = period | RTC_PITEN_bm;
+	DISABLE_INTERRUPTS();
+	tick_step = step;
+	ENABLE_INTERRUPTS();
+}
+
+// Whether it is time for low power mode
+bool lowPowerWanted() {
+	return !config.on && config_written && !eeprom_busy && leds_updated && !ledsBusy() && 
+		!serialBusy() && controlIdleFor(LOW_POWER_DELAY_MS) &&
+		!gestureSettling() &&
+		ticks() - last_touched_millis >= LOW_POWER_DELAY_MS &&
+		ticks() - last_sound_millis >= LOW_POWER_DELAY_MS;
+}
+
+// Sleeps in standby until woken by a control or a sound
+void lowPowerSleep() {
+	low_power_wake = false;
+	SLPCTRL.CTRLA = SLPCTRL_SMODE_STDBY_gc | SLPCTRL_SEN_bm;
+	setControlSense(PORT_ISC_BOTHEDGES_gc);
+	micLowPower(true);
+	setTickPeriod(RTC_PERIOD_CYC32768_gc, 1024);
+	
+	// Interrupts are enabled by the sei just before sleeping, so a wake up
+	// can't be missed between the test and the sleep.
+	DISABLE_INTERRUPTS();
+	while (!low_power_wake) {
+		ENABLE_INTERRUPTS();
+		__builtin_avr_sleep();
+		DISABLE_INTERRUPTS();
+	}
+	ENABLE_INTERRUPTS();
+	
+	setTickPeriod(RTC_PERIOD_CYC32_gc, 1);
+	micLowPower(false);
+	setControlSense(PORT_ISC_INTDISABLE_gc);
+}
+
+#endif
+
+//////////////////////////////////////////////////////////////////////
+// Scheduler
+// The main loop wakes every tick and runs whichever tasks are due. Each task
+// has a period in ticks, and may also have a ready function, so that it 
+// only runs when there is something to do. Idle tasks only run if the tick 
+// hasn't already been used up by the tasks before them.
+
+// Holding the button this long switches to the next preset, instead of 
+// toggling on release
+#define LONG_PRESS_MS 800
+
+// Whether the button is down and hasn't yet been acted on, and when it went 
+// down
+bool button_pressed;
+uint16_t button_press_tick;
+
+// Figure out what's going on with the button
+void buttonTask() {
+	int8_t b = checkTouch(readButton());
+	if (b == 1) {
+		button_pressed = true;
+		button_press_tick = ticks16();
+	} else if (button_pressed && b == -1) {
+		button_pressed = false;
+		toggleOn();
+	} else if (button_pressed && (uint16_t) (ticks16() - button_press_tick) >= LONG_PRESS_MS) {
+		button_pressed = false;
+		if (config.on) {
+			nextPreset();
+		} else {
+			toggleOn();
+		}
+	}
+}
+
+bool encodersReady() {
+	return enc1_delta != 0 || enc2_delta != 0;
+}
+
+// Read the encoders - update hue and brightness if lamp on
+void encodersTask() {
+	int8_t re1 = checkTouch(readEncoder1());
+	int8_t re2 = checkTouch(readEncoder2());
 	if (config.on) {
-		// https://en.wikipedia.org/wiki/HSL_and_HSV#HSL_to_RGB
-		// v is L (because lowercase l looks like 1 and is confusing). 
-		// v range 0-255 instead of 0-1. 
-		uint16_t v = (config.brightness * config.brightness) / 16;
-		v = min(v, 255); // in case config.brightness == 64
+		updateBrightness(re1);
+		updateHue(re2);
+	}
+}
+
+// Read mic and act on any gestures
+void micTask() {
+	switch (micRead()) {
+	case ACTION_TOGGLE:
+		toggleOn();
+		break;
+	case ACTION_BRIGHTNESS_STEP:
+		if (config.on) {
+			stepBrightness();
+		}
+		break;
+	case ACTION_NEXT_PRESET:
+		if (config.on) {
+			nextPreset();
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+// Update LEDs if anything changed
+bool ledsReady() {
+	return !leds_updated && !ledsBusy() && ledFrameDue();
+}
+
+// Update config if required
+bool configReady() {
+	return !config_written && !eeprom_busy;
+}
+
+#if CAPTURE_SQUARES || CAPTURE_RAW
+// Send any capture frames that are waiting
+void captureTask() {
+#if CAPTURE_SQUARES
+	captureSend(&capture_squares, SERIAL_FRAME_SQUARES);
+#endif
+#if CAPTURE_RAW
+	captureSend(&capture_raw, SERIAL_FRAME_RAW);
+#endif
+}
+#endif
+
+#if INSTRUMENTATION
+void reportTask();
+bool reportReady();
+#endif
+
+#if LOW_POWER_MODE
+void schedulerResync();
+
+void lowPowerTask() {
+	lowPowerSleep();
+	// The tick jumped while asleep
+	schedulerResync();
+}
+#endif
+
+// Task only runs if earlier tasks finished within the tick
+#define TASK_IDLE 1
+
+typedef struct {
+	void (*run)(void);
+	// Returns true if there is work to do. NULL to run every period.
+	bool (*ready)(void);
+	// Ticks between runs, at most 255
+	uint8_t period;
+	uint8_t flags;
+} Task;
+
+// Tasks, in the order they run in a tick
+static const Task tasks[] PROGMEM = {
+	{ micTask, NULL, 1, 0 },
+	{ encodersTask, encodersReady, 1, 0 },
+	{ buttonTask, NULL, 4, 0 },
+	{ maybeUpdateLeds, ledsReady, 1, 0 },
+#if SERIAL_CONTROL
+	{ controlTask, controlReady, 1, 0 },
+#endif
+	{ maybeWriteConfig, configReady, 1, TASK_IDLE },
+#if LOW_POWER_MODE
+	{ lowPowerTask, lowPowerWanted, 1, TASK_IDLE },
+#endif
+#if CAPTURE_SQUARES || CAPTURE_RAW
+	{ captureTask, NULL, 1, 0 },
+#endif
+#if INSTRUMENTATION
+	{ reportTask, reportReady, 1, 0 },
+#endif
+};
+
+#define NUM_TASKS (sizeof(tasks) / sizeof(Task))
+
+// When each task is next due
+ShortDeadline task_deadlines[NUM_TASKS];
+
+// Number of times each task without a ready function ran a whole period or
+// more late
+uint16_t task_overruns[NUM_TASKS];
+
+// Number of ticks where the tasks took longer than the tick
+uint16_t scheduler_overruns;
+
+#if INSTRUMENTATION
+// Time for each task, and for all the tasks in a tick
+StageStats task_stats[NUM_TASKS];
+StageStats tick_stats;
+
+// Tick of the last run, for counting missed ticks
+uint16_t scheduler_last_tick;
+#endif
+
+// Whether a task called schedulerResync() during this run, so the ticks it
+// slept through aren't an overrun
+bool scheduler_resynced;
+
+// Makes every task due now, after the tick has jumped
+void schedulerResync() {
+	uint16_t tick = ticks16();
+	for (uint8_t i = 0; i < NUM_TASKS; i++) {
+		task_deadlines[i] = tick;
+	}
+	scheduler_resynced = true;
+#if INSTRUMENTATION
+	// The next run may be in this same tick
+	scheduler_last_tick = tick - 1;
+#endif
+}
+
+// Runs the tasks that are due this tick
+void schedulerRun() {
+	uint16_t tick = ticks16();
+	scheduler_resynced = false;
+#if INSTRUMENTATION
+	uint16_t tick_start = instrumentNow();
+	missed_ticks += (uint16_t) (tick - scheduler_last_tick) - 1;
+	scheduler_last_tick = tick;
+#endif
+	for (uint8_t i = 0; i < NUM_TASKS; i++) {
+		const Task *task = &tasks[i];
+		if ((int16_t) (tick - task_deadlines[i]) < 0) {
+			continue;
+		}
+		if ((pgm_read_byte(&task->flags) & TASK_IDLE) && ticks16() != tick) {
+			continue;
+		}
+		bool (*ready)(void) = pgm_read_ptr(&task->ready);
+		if (ready && !ready()) {
+			continue;
+		}
 		
-		// Artificially limit to 1 to ensure LEDs minimally on if 
-		// lamp is supposed to be on
-		v = max(v, 1);
+		uint8_t period = pgm_read_byte(&task->period);
+		if (ready) {
+			task_deadlines[i] = tick + period;
+		} else if ((uint16_t) (tick - task_deadlines[i]) >= period) {
+			// Missed at least one run. Start again from now.
+			task_overruns[i]++;
+			task_deadlines[i] = tick + period;
+		} else {
+			task_deadlines[i] += period;
+		}
 		
-		// S is assumed to be 1 (range 0-1)
-		// Calculate chroma - 0 to 255.
-		uint16_t c = (255 - abs((2 * (int16_t) v) - 255)); 
-		// x is 0 - 255
-		uint8_t hue_region = config.hue >> 5; // top 3 bits of region are hue range (0-5)
-		uint8_t hue_val = config.hue & 0x1f; // bottom 5 bits are val
-		uint16_t xt = 8 * (hue_region & 1 ? hue_val : 32-hue_val);
-		uint16_t x = (c * (256 - xt)) >> 8; // scale x down to range 0 to 255
-		uint8_t r = 0, g = 0, b = 0;
-		switch (hue_region) {
-		case 0: r = c; g = x; break;
-		case 1: r = x; g = c; break;
-		case 2: g = c; b = x; break;
-		case 3: g = x; b = c; break;
-		case 4: r = x; b = c; break;
-		default: r = c; b = x;
-		}
-		uint16_t m = v - c/2;
-		sendLeds(min(r + m, 255), min(g + m, 255), min(b + m, 255));
-	} else {
-		sendLeds(0, 0, 0);
+		void (*run)(void) = pgm_read_ptr(&task->run);
+#if INSTRUMENTATION
+		uint16_t start = instrumentNow();
+		run();
+		stageRecord(&task_stats[i], start);
+#else
+		run();
+#endif
 	}
-	leds_updated = true;
+	// A task slept through the ticks since, so neither counts as an overrun
+	if (scheduler_resynced) {
+		return;
+	}
+	if (ticks16() != tick) {
+		scheduler_overruns++;
+	}
+#if INSTRUMENTATION
+	stageRecord(&tick_stats, tick_start);
+#endif
 }
 
+#if INSTRUMENTATION
 
-// How long to wait between last change and writing config eeprom
-#define CONFIG_WRITE_MS 500
+#define REPORT_MS 1024
+
+// Payload of SERIAL_FRAME_TIMING. All values after N are little endian 
+// uint16_t, and times are in TCA0 counts of 0.8uS.
+//   N          number of tasks
+//   missed_ticks, scheduler_overruns
+//   min, max, average for the whole tick
+//   min, max, average for LED frames sent with interrupts disabled
+//   min, max, average, overruns for each of the N tasks
+// A stage that didn't run reports zeros. LED frames are only timed with 
+// LED_TRANSPORT_BITBANG.
+// The frame must fit in serial_tx, which allows up to 13 tasks
+#define REPORT_LEN (1 + 4 + 12 + 8 * NUM_TASKS)
+
+uint8_t report[REPORT_LEN];
+
+// Whether report is waiting for room in serial_tx
+bool report_pending;
+
+// Tick when the last report was started
+uint16_t report_tick;
+
+static uint8_t *reportPut(uint8_t *p, uint16_t v) {
+	*p++ = v;
+	*p++ = v >> 8;
+	return p;
+}
+
+// Adds min, max and average to the report, and resets the stats
+static uint8_t *reportStage(uint8_t *p, StageStats *stats) {
+	p = reportPut(p, stats->min);
+	p = reportPut(p, stats->max);
+	p = reportPut(p, stats->count ? stats->sum / stats->count : 0);
+	stageReset(stats);
+	return p;
+}
+
+void reportStart() {
+	uint8_t *p = report;
+	*p++ = NUM_TASKS;
+	p = reportPut(p, missed_ticks);
+	p = reportPut(p, scheduler_overruns);
+	missed_ticks = 0;
+	scheduler_overruns = 0;
+	p = reportStage(p, &tick_stats);
+	p = reportStage(p, &led_frame_stats);
+	for (uint8_t i = 0; i < NUM_TASKS; i++) {
+		p = reportStage(p, &task_stats[i]);
+		p = reportPut(p, task_overruns[i]);
+		task_overruns[i] = 0;
+	}
+	report_pending = true;
+}
+
+bool reportReady() {
+	return report_pending || (uint16_t) (ticks16() - report_tick) >= REPORT_MS;
+}
+
+// Starts a report once a second, then queues it as soon as there is room
+void reportTask() {
+	if (!report_pending) {
+		reportStart();
+		report_tick = ticks16();
+	}
+	if (serialWriteFrame(SERIAL_FRAME_TIMING, report, REPORT_LEN)) {
+		report_pending = false;
+	}
+}
+
+#endif
+
+//////////////////////////////////////////////////////////////////////
+// Benchmark
+// A BENCHMARK build times the hot paths with TCB1 counting CPU cycles, 
+// with interrupts disabled so that only the code itself is counted. Each 
+// benchmark runs BENCH_RUNS times with varying inputs, and the results are 
+// sent about once a second in a SERIAL_FRAME_BENCHMARK frame:
+//   N          number of benchmarks
+//   min, max, average cycles for each benchmark, as little endian uint16_t
+// The benchmarks, in order, are:
+//   sendByte() and sendFrameBytes() for a whole frame, including flags 
+//              polled between LEDs, with LED_TRANSPORT_BITBANG. With
+//              LED_TRANSPORT_SPI, SPI0_INT_vect per SPI byte, and the 
+//              cycles left to the main loop during a whole frame, both
+//              with interrupts enabled, so other ISRs count as SPI0_INT_vect
+//   configToLeds(), a fade step, the colour lookups and frame buffer update
+//   micAccumulate(), per mic reading
+//   clapBlock(), the whole detector for one block
+
+#if BENCHMARK
+
+#define SERIAL_FRAME_BENCHMARK 'B'
+
+#define BENCH_RUNS 64
+
+#define BENCH_SEND_BYTE 0
+#define BENCH_SEND_FRAME 1
+#define BENCH_CONFIG_TO_LEDS 2
+#define BENCH_MIC_ACCUMULATE 3
+#define BENCH_CLAP_BLOCK 4
+#define NUM_BENCHES 5
+
+StageStats bench_stats[NUM_BENCHES];
+
+// Cycles counted for an empty benchmark
+uint16_t bench_overhead;
+
+// Times code, adding the cycles to bench_stats[index]
+#define BENCH(index, code) do { \
+	DISABLE_INTERRUPTS(); \
+	uint16_t start = TCB1.CNT; \
+	code; \
+	uint16_t t = TCB1.CNT - start - bench_overhead; \
+	ENABLE_INTERRUPTS(); \
+	stageAdd(&bench_stats[index], t); \
+} while (0)
+
+void benchStart() {
+	TCB1.CCMP = 0xffff;
+	TCB1.CTRLB = TCB_CNTMODE_INT_gc;
+	TCB1.CTRLA = TCB_CLKSEL_CLKDIV1_gc | TCB_ENABLE_bm;
+	
+	BENCH(0, );
+	bench_overhead = bench_stats[0].min;
+	stageReset(&bench_stats[0]);
+}
+
+#if LED_TRANSPORT == LED_TRANSPORT_SPI
+// Spins until the SPI frame is done, or for limit spins
+static __attribute__((noinline)) uint16_t benchSpin(uint16_t limit) {
+	uint16_t spins = 0;
+	while (led_spi_busy && spins != limit) {
+		spins++;
+	}
+	return spins;
+}
+
+// Counts the spins the main loop gets through while a frame is sent, then
+// times as many spins with interrupts disabled. The rest of the frame time
+// went to the ISR.
+static void benchSpiFrame() {
+	uint16_t start = TCB1.CNT;
+	sendFrame(LED_FRAME_LEN);
+	uint16_t spins = benchSpin(UINT16_MAX);
+	uint16_t total = TCB1.CNT - start;
+	
+	DISABLE_INTERRUPTS();
+	led_spi_busy = true;
+	start = TCB1.CNT;
+	benchSpin(spins);
+	uint16_t foreground = TCB1.CNT - start;
+	led_spi_busy = false;
+	ENABLE_INTERRUPTS();
+	
+	stageAdd(&bench_stats[BENCH_SEND_BYTE], (total - foreground) / (LED_FRAME_LEN * 3));
+	stageAdd(&bench_stats[BENCH_SEND_FRAME], foreground);
+}
+#endif
+
+void benchRun() {
+	config.on = true;
+	for (uint8_t i = 0; i < BENCH_RUNS; i++) {
+#if LED_TRANSPORT == LED_TRANSPORT_BITBANG
+		BENCH(BENCH_SEND_BYTE, sendByte(i));
+		BENCH(BENCH_SEND_FRAME, sendFrameBytes(LED_FRAME_LEN));
+#else
+		benchSpiFrame();
+#endif
+		config.brightness = i & (MAX_BRIGHT - 1);
+		config.hue = i * 3;
+		BENCH(BENCH_CONFIG_TO_LEDS, configToLeds());
+		BENCH(BENCH_MIC_ACCUMULATE, micAccumulate(MID_READING - 128 + i * 4));
+		AudioLevel level = (i & 0x1c) == 0x0c ? LOUD : (i & 3) == 3 ? MID : QUIET;
+		BENCH(BENCH_CLAP_BLOCK, clapBlock(level));
+	}
+	audio_squares = 0;
+	sample_count = 0;
+}
+
+void benchReport() {
+	uint8_t payload[1 + 6 * NUM_BENCHES];
+	uint8_t *p = payload;
+	*p++ = NUM_BENCHES;
+	for (uint8_t i = 0; i < NUM_BENCHES; i++) {
+		StageStats *stats = &bench_stats[i];
+		uint16_t avg = stats->count ? stats->sum / stats->count : 0;
+		*p++ = stats->min;
+		*p++ = stats->min >> 8;
+		*p++ = stats->max;
+		*p++ = stats->max >> 8;
+		*p++ = avg;
+		*p++ = avg >> 8;
+		stageReset(stats);
+	}
+	while (!serialWriteFrame(SERIAL_FRAME_BENCHMARK, payload, sizeof(payload)));
+}
+
+// Runs the benchmarks forever
+void benchMain() {
+	benchStart();
+	while (1) {
+		benchRun();
+		benchReport();
+		uint16_t start = ticks16();
+		while ((uint16_t) (ticks16() - start) < 1024);
+	}
+}
+
+#endif
 
 //////////////////////////////////////////////////////////////////////
 // Main loop
 // move written and write time out to globals
 
+// Standby stops the clock of peripherals that are still sending or 
+// receiving, so use idle sleep until they finish
+void setSleepMode() {
+	bool busy = serialBusy() || controlBusy();
+#if LED_TRANSPORT == LED_TRANSPORT_SPI
+	busy = busy || led_spi_busy;
+#endif
+	SLPCTRL.CTRLA = (busy ? SLPCTRL_SMODE_IDLE_gc : SLPCTRL_SMODE_STDBY_gc) | SLPCTRL_SEN_bm;
+}
+
+// Lights the LEDs from the saved config straight out of reset, before 
+// atmel_start_init() and the mic are set up. This needs only the main clock,
+// which runs at 20MHz / 6 after reset, the EEPROM, which is memory mapped,
+// and the LED data pin. atmel_start_init() sets the clock and the pin up 
+// the same way again, which doesn't disturb the LEDs.
+// The lamp comes on at its saved colour rather than fading up. Most of the 
+// remaining delay from power on is the start up time in the SYSCFG1 fuse,
+// 64ms by default.
+// The SPI transport is interrupt driven, so with it the first frame waits 
+// until after atmel_start_init().
+void fastBoot() {
+	_PROTECTED_WRITE(CLKCTRL.MCLKCTRLB, 0);
+	readConfig();
+	leds_cut = true;
+#if LED_TRANSPORT == LED_TRANSPORT_BITBANG
+	LED_DATA_VPORT.OUT &= ~LED_DATA_bm;
+	LED_DATA_VPORT.DIR |= LED_DATA_bm;
+	maybeUpdateLeds();
+	// sendFrame() enabled interrupts, but atmel_start_init() expects them 
+	// off
+	DISABLE_INTERRUPTS();
+#endif
+}
+
 int main(void)
 {
+	fastBoot();
+	
 	// Initializes MCU, drivers and middleware 
 	atmel_start_init();
-	readConfig();
+#if INSTRUMENTATION
+	instrumentStart();
+#endif
+	encodersStart();
+#if MIC_MODE != MIC_MODE_POLLED
+	micStart();
+#endif
+#if LED_TRANSPORT == LED_TRANSPORT_SPI
+	ledStart();
 	maybeUpdateLeds();
+#endif
+	patternsInit();
+	schedulerResync();
 	
 	USART_0_enable();
-
-	uint32_t last_awake = tick_millis;
+#if SERIAL_CONTROL
+	serialStart();
+#endif
+	// Saves a migrated config now that interrupts are enabled, so that
+	// NVMCTRL_EE_vect can program it
+	ENABLE_INTERRUPTS();
+	if (config_migrated) {
+		writeConfig();
+	}
+#if CAPTURE_SQUARES || CAPTURE_RAW
+	captureStart();
+#endif
+#if BENCHMARK
+	benchMain();
+#endif
+
+	uint16_t last_awake = ticks16();
 	while (1) {
 		// Sleep until there's a new millisecond
 		// CPU wakes on RTC interrupt.
-		while (last_awake == tick_millis) {
+		while (last_awake == ticks16()) {
+			setSleepMode();
 			__builtin_avr_sleep();
 		}
-		last_awake = tick_millis;
-		
-		// Figure out what's going on with the button
-		int8_t b = checkTouch(readButton());
-		if (b == 1) {
-			toggleOn();
-		}
-		
-		// Read the encoders - update hue and brightness if lamp on
-		int8_t re1 = checkTouch(readEncoder1());
-		int8_t re2 = checkTouch(readEncoder2());
-		if (config.on) {
-			updateBrightness(re1);
-			updateHue(re2);
-		}
-		
-		// Read mic and determine whether there has been a double clap
-		bool double_clap = micRead();
-		if (double_clap) {
-			toggleOn();
-		}
-		
-		// Update LEDs if anything changed
-		maybeUpdateLeds();
+		last_awake = ticks16();
 		
-		// Update config it required
-		maybeWriteConfig();
+		schedulerRun();
 	}
 }
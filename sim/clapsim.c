@@ -0,0 +1,329 @@
+/*
+ * Copyright 2019 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+// Host simulation of the clap detector in ClapSwitch/clap.c. Replays audio 
+// traces through the same code as the firmware, and reports how well and 
+// how fast it detected the gestures marked in them.
+//
+// Build and run from the top of the repository:
+//   gcc -O2 -std=gnu99 -IClapSwitch -o clapsim sim/clapsim.c ClapSwitch/clap.c
+//   ./clapsim trace.txt ...
+//   ./clapsim -g 1000
+//
+// A trace is text, one item per line:
+//   369         a mic reading, 0..1023
+//   @toggle     a double clap ended here
+//   @step       a triple clap ended here
+//   @preset     a quadruple clap ended here
+//   # ...       a comment
+// With -s, the numbers are instead block mean squares, as sent by 
+// CAPTURE_SQUARES. With -g N, a trace of N random gestures is generated
+// instead of reading files, around a mic bias of -b (default MID_READING)
+// with background noise of amplitude -n (default 20). -t adds pairs of 
+// low frequency thumps between the gestures, which should not be detected.
+//
+// A detection of the expected action within LATENCY_LIMIT_BLOCKS of a mark
+// is a true positive, any other detection is a false positive, and a mark 
+// with no detection is a miss. Exits with 1 if there were any false 
+// positives or misses, so it can be used to check detector changes. The 
+// detector's ClapStats are printed after the results.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "clap.h"
+
+#define LATENCY_LIMIT_BLOCKS 80
+
+// Milliseconds per block, near enough
+#define BLOCK_MS 16
+
+static bool squares_mode;
+
+// Readings in the current block
+static uint32_t audio_squares;
+static uint8_t sample_count;
+
+static uint32_t blocks;
+
+// Expected action of the oldest unmatched mark, and when it was made
+static GestureAction expected;
+static uint32_t expected_block;
+
+static uint32_t marks, true_positives, false_positives, misses;
+static uint32_t wrong_actions;
+static uint64_t latency_sum;
+static uint32_t latency_max;
+
+// Time spent in the detector, in nanoseconds
+static uint64_t time_sum;
+static uint64_t time_max;
+
+static uint64_t nowNs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void checkMissed(void) {
+	if (expected != ACTION_NONE && blocks - expected_block > LATENCY_LIMIT_BLOCKS) {
+		misses++;
+		expected = ACTION_NONE;
+	}
+}
+
+static void mark(GestureAction action) {
+	checkMissed();
+	if (expected != ACTION_NONE) {
+		// The previous mark was never matched
+		misses++;
+	}
+	marks++;
+	expected = action;
+	expected_block = blocks;
+}
+
+static void block(uint32_t squares) {
+	uint64_t start = nowNs();
+	GestureAction action = clapBlock(calculateCurrentLevel(squares));
+	uint64_t t = nowNs() - start;
+	time_sum += t;
+	if (t > time_max) {
+		time_max = t;
+	}
+	blocks++;
+
+	if (action != ACTION_NONE) {
+		if (action == expected) {
+			uint32_t latency = blocks - expected_block;
+			true_positives++;
+			latency_sum += latency;
+			if (latency > latency_max) {
+				latency_max = latency;
+			}
+			expected = ACTION_NONE;
+		} else {
+			false_positives++;
+			if (expected != ACTION_NONE) {
+				wrong_actions++;
+			}
+		}
+	}
+	checkMissed();
+}
+
+static void reading(uint16_t r) {
+	audio_squares += readingSquare(r);
+	if (++sample_count == NUM_SAMPLES_PER_THRESHOLD) {
+		block(audio_squares);
+		audio_squares = 0;
+		sample_count = 0;
+	}
+}
+
+static void value(long v) {
+	if (squares_mode) {
+		block(v * NUM_SAMPLES_PER_THRESHOLD);
+	} else {
+		reading(v);
+	}
+}
+
+static int replay(const char *path) {
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		return 1;
+	}
+	char line[64];
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#' || line[0] == '\n') {
+			continue;
+		}
+		if (strncmp(line, "@toggle", 7) == 0) {
+			mark(ACTION_TOGGLE);
+		} else if (strncmp(line, "@step", 5) == 0) {
+			mark(ACTION_BRIGHTNESS_STEP);
+		} else if (strncmp(line, "@preset", 7) == 0) {
+			mark(ACTION_NEXT_PRESET);
+		} else {
+			value(strtol(line, NULL, 10));
+		}
+	}
+	fclose(f);
+	return 0;
+}
+
+// Deterministic random numbers for generated traces
+static uint32_t rng = 1;
+
+static uint32_t rnd(uint32_t n) {
+	rng ^= rng << 13;
+	rng ^= rng >> 17;
+	rng ^= rng << 5;
+	return rng % n;
+}
+
+// Mic bias and background noise amplitude of generated traces, and whether
+// to add thumps between gestures
+static uint16_t bias = MID_READING;
+static uint16_t background = 20;
+static bool thumps;
+
+static void noise(uint32_t ms, uint16_t amplitude) {
+	for (uint32_t i = 0; i < ms; i++) {
+		reading(bias - amplitude + rnd(2 * amplitude + 1));
+	}
+}
+
+// A clap is a short loud burst, trailing off
+static void clap(void) {
+	uint32_t ms = 32 + rnd(33);
+	for (uint32_t i = 0; i < ms; i++) {
+		uint16_t amplitude = 180 + rnd(70);
+		reading(rnd(2) ? bias + amplitude : bias - amplitude);
+	}
+	noise(16 * rnd(2), 90);
+}
+
+// Claps separated by gaps of min_gap to max_gap ms
+static void claps(int n, uint32_t min_gap, uint32_t max_gap) {
+	for (int i = 0; i < n; i++) {
+		if (i) {
+			noise(min_gap + rnd(max_gap - min_gap + 1), background);
+		}
+		clap();
+	}
+}
+
+// A thump, like a door slam or a bass note: loud, but only 40Hz. A 25ms 
+// triangle wave, for 64 to 128ms.
+static void thump(void) {
+	uint32_t ms = 64 + rnd(65);
+	for (uint32_t i = 0; i < ms; i++) {
+		int16_t phase = i % 25;
+		int16_t wave = phase < 13 ? phase * 40 - 240 : (25 - phase) * 40 - 240;
+		reading(bias + wave);
+	}
+}
+
+static void generate(uint32_t n) {
+	for (uint32_t i = 0; i < n; i++) {
+		// Long enough for the lockout and the quiet before a gesture
+		noise(3000 + rnd(2000), background);
+		if (thumps) {
+			// Two of them, spaced like a double clap
+			thump();
+			noise(100 + rnd(500), background);
+			thump();
+			noise(3000, background);
+		}
+		switch (rnd(3)) {
+		case 0:
+			claps(2, 100, 600);
+			mark(ACTION_TOGGLE);
+			break;
+		case 1:
+			claps(3, 100, 250);
+			mark(ACTION_BRIGHTNESS_STEP);
+			break;
+		default:
+			claps(4, 100, 250);
+			mark(ACTION_NEXT_PRESET);
+			break;
+		}
+	}
+	noise(3000, background);
+}
+
+int main(int argc, char **argv) {
+	patternsInit();
+
+	int i = 1;
+	long generated = 0;
+	for (; i < argc && argv[i][0] == '-'; i++) {
+		if (strcmp(argv[i], "-s") == 0) {
+			squares_mode = true;
+		} else if (strcmp(argv[i], "-g") == 0 && i + 1 < argc) {
+			generated = strtol(argv[++i], NULL, 10);
+		} else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+			bias = strtol(argv[++i], NULL, 10);
+		} else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+			background = strtol(argv[++i], NULL, 10);
+		} else if (strcmp(argv[i], "-t") == 0) {
+			thumps = true;
+		} else {
+			fprintf(stderr, "usage: %s [-s] trace... | [-b bias] [-n noise] [-t] -g count\n", argv[0]);
+			return 2;
+		}
+	}
+	if (generated) {
+		squares_mode = false;
+		generate(generated);
+	} else if (i == argc) {
+		fprintf(stderr, "usage: %s [-s] trace... | [-b bias] [-n noise] [-t] -g count\n", argv[0]);
+		return 2;
+	}
+	for (; i < argc; i++) {
+		if (replay(argv[i])) {
+			return 2;
+		}
+	}
+	if (expected != ACTION_NONE) {
+		misses++;
+	}
+
+	printf("blocks           %u (%.1f s)\n", blocks, blocks * BLOCK_MS / 1000.0);
+	printf("marked gestures  %u\n", marks);
+	printf("true positives   %u\n", true_positives);
+	printf("false positives  %u (%u of them the wrong gesture)\n", false_positives, wrong_actions);
+	printf("misses           %u\n", misses);
+	if (true_positives) {
+		printf("latency          mean %.1f ms, max %u ms after the mark\n",
+			(double) latency_sum * BLOCK_MS / true_positives, latency_max * BLOCK_MS);
+	}
+	if (blocks) {
+		printf("detector time    mean %.0f ns, max %llu ns per block (host)\n",
+			(double) time_sum / blocks, (unsigned long long) time_max);
+	}
+#if CLAP_STATS
+	// The firmware's ClapStats, which stop counting at 65535
+	printf("levels           %u quiet, %u mid, %u loud, %u loud without onset\n",
+		clap_stats.levels[QUIET], clap_stats.levels[MID], clap_stats.levels[LOUD], clap_stats.no_onset);
+	printf("squares / loud  ");
+	for (int b = 0; b < CLAP_HISTOGRAM_BINS; b++) {
+		printf(" %u", clap_stats.squares[b]);
+	}
+	printf("\n");
+	printf("gestures         %u matched, %u superseded, %u locked out\n",
+		clap_stats.matched, clap_stats.superseded, clap_stats.locked_out);
+	printf("rejected        ");
+	for (int p = 0; p < CLAP_PATTERNS; p++) {
+		printf(" %u", clap_stats.rejected[p]);
+	}
+	printf("\n");
+#if CLAP_STAGE_STATS
+	printf("rejected stages  ");
+	for (int st = 0; st < CLAP_STAGES; st++) {
+		printf("%u%c", clap_stage_rejected[st], st + 1 < CLAP_STAGES ? ' ' : '\n');
+	}
+#endif
+#endif
+	return false_positives || misses;
+}